@@ -0,0 +1,129 @@
+#include <atomic>
+#include <thread>
+#include <filesystem>
+
+#include "pipeline.cpp"
+
+using namespace std;
+
+// Simple wildcard match supporting '*' and '?'
+bool matches_pattern(const string &pattern, const string &name)
+{
+    size_t p = 0, n = 0, star = string::npos, resume = 0;
+    while (n < name.size())
+    {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n]))
+            p++, n++;
+        else if (p < pattern.size() && pattern[p] == '*')
+            star = p++, resume = n;
+        else if (star != string::npos)
+            p = star + 1, n = ++resume;
+        else
+            return false;
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        p++;
+    return p == pattern.size();
+}
+
+// Expands "test_cases/*" style arguments; wildcards are allowed in the last path component only
+vector<string> expand_scene_directories(const vector<string> &arguments)
+{
+    vector<string> directories;
+    for (const string &argument : arguments)
+    {
+        if (argument.find_first_of("*?") == string::npos)
+        {
+            directories.push_back(argument);
+            continue;
+        }
+
+        filesystem::path pattern_path(argument);
+        filesystem::path parent = pattern_path.parent_path().empty() ? "." : pattern_path.parent_path();
+        string pattern = pattern_path.filename().string();
+
+        vector<string> matched;
+        error_code ec;
+        for (const auto &entry : filesystem::directory_iterator(parent, ec))
+            if (entry.is_directory() && matches_pattern(pattern, entry.path().filename().string()) &&
+                filesystem::exists(entry.path() / "scene.txt"))
+                matched.push_back(entry.path().string());
+
+        if (matched.empty())
+            cerr << "No scene directories match: " << argument << endl;
+        sort(matched.begin(), matched.end());
+        directories.insert(directories.end(), matched.begin(), matched.end());
+    }
+    return directories;
+}
+
+// Renders every directory on a fixed pool of worker threads, returns the number of failed jobs
+int render_batch(const vector<string> &directories, unsigned int num_threads, size_t memory_cap, bool print_stats = false)
+{
+    vector<RenderReport> reports(directories.size());
+    atomic<size_t> next_job(0);
+
+    // Threads left over when there are fewer jobs than threads go to the jobs' multi-view rasterization
+    unsigned int workers_count = max(1u, min<unsigned int>(num_threads, directories.size()));
+    unsigned int job_threads = max(1u, num_threads / workers_count);
+
+    auto worker = [&]()
+    {
+        for (size_t job = next_job++; job < directories.size(); job = next_job++)
+        {
+            RenderReport &report = reports[job];
+            report.directory = directories[job];
+            try
+            {
+                render_scene(directories[job], report, memory_cap, job_threads);
+            }
+            catch (const exception &e)
+            {
+                report.error = e.what();
+            }
+        }
+    };
+
+    auto start_time = chrono::steady_clock::now();
+
+    num_threads = workers_count;
+    vector<thread> workers;
+    for (unsigned int i = 0; i < num_threads; i++)
+        workers.emplace_back(worker);
+    for (auto &t : workers)
+        t.join();
+
+    double total_seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+
+    // Summary
+    int failed = 0;
+    size_t total_triangles = 0;
+    cout << fixed << setprecision(3);
+    for (const RenderReport &report : reports)
+    {
+        if (!report.success)
+        {
+            failed++;
+            cout << "FAIL  " << report.directory << "  " << report.error << endl;
+            continue;
+        }
+        total_triangles += report.triangle_count;
+        double rate = report.seconds > 0 ? report.triangle_count / report.seconds : 0;
+        cout << "OK    " << report.directory << "  " << report.triangle_count << " triangles  "
+             << report.seconds * 1000 << " ms  " << rate << " triangles/s" << endl;
+    }
+    cout << reports.size() - failed << "/" << reports.size() << " jobs on " << num_threads << " threads in "
+         << total_seconds * 1000 << " ms  "
+         << (total_seconds > 0 ? total_triangles / total_seconds : 0) << " triangles/s" << endl;
+
+#ifdef RASTER_STATS
+    if (print_stats)
+        for (const RenderReport &report : reports)
+            if (report.success)
+                cout << "{\"directory\":\"" << report.directory << "\",\"stats\":" << report.stats << "}" << endl;
+#else
+    (void)print_stats;
+#endif
+
+    return failed;
+}
@@ -0,0 +1,261 @@
+#include <filesystem>
+#include <sstream>
+
+#include "pipeline.cpp"
+#include "generator.cpp"
+
+using namespace std;
+
+// Usage:
+//   benchmark generate <dir> [scene options]             write a synthetic scene.txt & config.txt into <dir>
+//   benchmark [--repeat R] [--work-dir DIR] <dir>...      benchmark existing scene directories, rendering a copy
+//                                                          of each under --work-dir so reference outputs stay intact
+//   benchmark [--repeat R] [--counts N,N,..] [scene options]
+//                                                          generate and benchmark a suite under --work-dir
+// Scene options: --triangles N --size-min PX --size-max PX --overdraw D --nesting K --group-size G
+//                --width W --height H --seed S
+// Each benchmarked scene prints one JSON object per line.
+
+class StageTiming
+{
+public:
+    string name;
+    double seconds = numeric_limits<double>::max();
+    size_t triangles = 0, fragments = 0, bytes = 0;
+};
+
+size_t file_bytes(const string &path)
+{
+    error_code ec;
+    size_t bytes = filesystem::file_size(path, ec);
+    return ec ? 0 : bytes;
+}
+
+// Times every pipeline stage of the scene in input_directory, keeping the fastest of `repeat` runs per stage.
+// The stage files, z_buffer.txt and out.bmp go to output_directory
+vector<StageTiming> benchmark_scene(const string &input_directory, const string &output_directory, int repeat)
+{
+    vector<StageTiming> stages(5);
+    stages[0].name = "modeling";
+    stages[1].name = "view";
+    stages[2].name = "projection";
+    stages[3].name = "rasterization";
+    stages[4].name = "output";
+
+    auto elapsed = [](chrono::steady_clock::time_point since)
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - since).count();
+    };
+
+    for (int run = 0; run < repeat; run++)
+    {
+        fastrand_seed();
+        RasterConfig config = read_raster_config(input_directory + "/config.txt");
+
+        ifstream scene_stream(input_directory + "/scene.txt");
+        if (!scene_stream.is_open())
+            throw invalid_argument("Unable to open " + input_directory + "/scene.txt");
+        ofstream stage1_stream(output_directory + "/stage1.txt");
+        ofstream stage2_stream(output_directory + "/stage2.txt");
+        ofstream stage3_stream(output_directory + "/stage3.txt");
+        stage1_stream << fixed << setprecision(7);
+        stage2_stream << fixed << setprecision(7);
+        stage3_stream << fixed << setprecision(7);
+
+        Camera camera;
+        vector<Triangle> triangles;
+        vector<TriangleGroup> groups;
+        vector<vector<double>> z_buffer;
+        bitmap_image image;
+        size_t fragments;
+
+        auto start = chrono::steady_clock::now();
+        scene_stream >> camera;
+        model_scene(scene_stream, triangles, stage1_stream, numeric_limits<size_t>::max(), &groups,
+                    TessellationView(camera.eye, camera.fovY, config.screen_height));
+        stage1_stream.close();
+        stages[0].seconds = min(stages[0].seconds, elapsed(start));
+
+        start = chrono::steady_clock::now();
+        transform_triangles(triangles, viewMatrix(camera.eye, camera.look, camera.up), stage2_stream);
+        stage2_stream.close();
+        stages[1].seconds = min(stages[1].seconds, elapsed(start));
+
+        start = chrono::steady_clock::now();
+        transform_triangles(triangles, projectionMatrix(camera.fovY, camera.aspectRatio, camera.near, camera.far), stage3_stream);
+        stage3_stream.close();
+        stages[2].seconds = min(stages[2].seconds, elapsed(start));
+
+        start = chrono::steady_clock::now();
+        fragments = rasterize(triangles, config, z_buffer, image, groups);
+        stages[3].seconds = min(stages[3].seconds, elapsed(start));
+
+        start = chrono::steady_clock::now();
+        save_outputs(z_buffer, image, config, output_directory);
+        stages[4].seconds = min(stages[4].seconds, elapsed(start));
+
+        for (int i = 0; i < 4; i++)
+            stages[i].triangles = triangles.size();
+        stages[3].fragments = fragments;
+    }
+
+    stages[0].bytes = file_bytes(output_directory + "/stage1.txt");
+    stages[1].bytes = file_bytes(output_directory + "/stage2.txt");
+    stages[2].bytes = file_bytes(output_directory + "/stage3.txt");
+    stages[4].bytes = file_bytes(output_directory + "/z_buffer.txt") + file_bytes(output_directory + "/out.bmp");
+
+    return stages;
+}
+
+string json_escape(const string &text)
+{
+    string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+void print_benchmark_json(const string &directory, const vector<StageTiming> &stages, ostream &output_stream)
+{
+    auto rate = [](double amount, double seconds)
+    {
+        return seconds > 0 ? amount / seconds : 0.0;
+    };
+
+    double total_seconds = 0;
+    for (const StageTiming &stage : stages)
+        total_seconds += stage.seconds;
+
+    ostringstream json;
+    json << fixed << setprecision(6);
+    json << "{\"scene\":\"" << json_escape(directory) << "\",\"triangles\":" << stages[0].triangles
+         << ",\"fragments\":" << stages[3].fragments << ",\"seconds\":" << total_seconds
+         << ",\"triangles_per_second\":" << rate(stages[0].triangles, total_seconds) << ",\"stages\":{";
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        const StageTiming &stage = stages[i];
+        json << (i ? "," : "") << "\"" << stage.name << "\":{\"seconds\":" << stage.seconds;
+        if (stage.triangles)
+            json << ",\"triangles_per_second\":" << rate(stage.triangles, stage.seconds);
+        if (stage.fragments)
+            json << ",\"fragments_per_second\":" << rate(stage.fragments, stage.seconds);
+        if (stage.bytes)
+            json << ",\"output_bytes\":" << stage.bytes
+                 << ",\"mb_per_second\":" << rate(stage.bytes / (1024.0 * 1024.0), stage.seconds);
+        json << "}";
+    }
+    json << "}}";
+
+    output_stream << json.str() << endl;
+}
+
+// Consumes a scene option at argv[i], returns false if argv[i] is not one
+bool parse_scene_option(int argc, char **argv, int &i, SceneParameters &parameters)
+{
+    string option = argv[i];
+    if (i + 1 >= argc)
+        return false;
+
+    if (option == "--triangles")
+        parameters.triangles = stoull(argv[++i]);
+    else if (option == "--size-min")
+        parameters.size_min = stod(argv[++i]);
+    else if (option == "--size-max")
+        parameters.size_max = stod(argv[++i]);
+    else if (option == "--overdraw")
+        parameters.overdraw = stod(argv[++i]);
+    else if (option == "--nesting")
+        parameters.nesting = stoi(argv[++i]);
+    else if (option == "--group-size")
+        parameters.group_size = max(1, stoi(argv[++i]));
+    else if (option == "--width")
+        parameters.screen_width = stoi(argv[++i]);
+    else if (option == "--height")
+        parameters.screen_height = stoi(argv[++i]);
+    else if (option == "--seed")
+        parameters.seed = stoul(argv[++i]);
+    else
+        return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    SceneParameters parameters;
+    int repeat = 1;
+    string work_directory = "bench_scenes";
+    vector<size_t> counts = {1000, 10000, 100000};
+    vector<string> directories;
+
+    bool generate_only = argc > 1 && string(argv[1]) == "generate";
+    for (int i = generate_only ? 2 : 1; i < argc; i++)
+    {
+        string option = argv[i];
+        if (parse_scene_option(argc, argv, i, parameters))
+            continue;
+        else if (option == "--repeat" && i + 1 < argc)
+            repeat = max(1, stoi(argv[++i]));
+        else if (option == "--work-dir" && i + 1 < argc)
+            work_directory = argv[++i];
+        else if (option == "--counts" && i + 1 < argc)
+        {
+            counts.clear();
+            stringstream list(argv[++i]);
+            string count;
+            while (getline(list, count, ','))
+                counts.push_back(stoull(count));
+        }
+        else
+            directories.push_back(option);
+    }
+
+    try
+    {
+        if (generate_only)
+        {
+            if (directories.size() != 1)
+            {
+                cerr << "generate expects exactly one output directory" << endl;
+                return -1;
+            }
+            filesystem::create_directories(directories[0]);
+            double overdraw = generate_scene(parameters, directories[0]);
+            cerr << "Generated " << parameters.triangles << " triangles, expected overdraw " << overdraw << endl;
+            return 0;
+        }
+
+        if (directories.empty())
+        {
+            for (size_t count : counts)
+            {
+                string directory = work_directory + "/triangles_" + to_string(count);
+                filesystem::create_directories(directory);
+                parameters.triangles = count;
+                generate_scene(parameters, directory);
+                print_benchmark_json(directory, benchmark_scene(directory, directory, repeat), cout);
+            }
+        }
+
+        // Existing scenes render into a scratch directory named after them
+        for (const string &directory : directories)
+        {
+            filesystem::path scene_path = filesystem::path(directory).lexically_normal();
+            if (!scene_path.has_filename())
+                scene_path = scene_path.parent_path();
+            string output_directory = work_directory + "/" + scene_path.filename().string();
+            filesystem::create_directories(output_directory);
+            print_benchmark_json(directory, benchmark_scene(directory, output_directory, repeat), cout);
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
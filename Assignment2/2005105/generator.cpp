@@ -0,0 +1,113 @@
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <string>
+
+using namespace std;
+
+// Synthetic scene description; sizes are approximate projected edge lengths in pixels
+class SceneParameters
+{
+public:
+    size_t triangles = 1000;
+    double size_min = 4, size_max = 64;
+    double overdraw = 4;
+    int nesting = 0;
+    int group_size = 16;
+    int screen_width = 500, screen_height = 500;
+    unsigned int seed = 105;
+};
+
+// Fixed camera of every generated scene: looking down -z from (0, 0, 50) with a 60 degree fovY
+const double GENERATOR_EYE_DISTANCE = 50.0;
+const double GENERATOR_FOV_Y = 60.0;
+const double GENERATOR_DEPTH_RANGE = 20.0;
+
+// Writes scene.txt and config.txt into an existing directory, returns the expected average overdraw
+double generate_scene(const SceneParameters &parameters, const string &directory)
+{
+    ofstream scene_stream(directory + "/scene.txt");
+    ofstream config_stream(directory + "/config.txt");
+    if (!scene_stream.is_open() || !config_stream.is_open())
+        throw invalid_argument("Unable to write scene into " + directory);
+
+    config_stream << parameters.screen_width << " " << parameters.screen_height << endl;
+    config_stream << "-1" << endl;
+    config_stream << "-1" << endl;
+    config_stream << "-1.0 1.0" << endl;
+
+    scene_stream << fixed << setprecision(7);
+    scene_stream << "0.0 0.0 " << GENERATOR_EYE_DISTANCE << endl;
+    scene_stream << "0.0 0.0 0.0" << endl;
+    scene_stream << "0.0 1.0 0.0" << endl;
+    scene_stream << GENERATOR_FOV_Y << " 1.0 1.0 " << 2 * GENERATOR_EYE_DISTANCE << endl;
+
+    mt19937 random_engine(parameters.seed);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+
+    // Triangle sizes are log-uniform between the limits so every order of magnitude is equally common.
+    // They are drawn once here for the total area and replayed from a copy of the engine while writing,
+    // so the scene streams out without being held in memory
+    double log_min = log(parameters.size_min), log_max = log(parameters.size_max);
+    mt19937 size_engine = random_engine;
+    auto next_size = [&](mt19937 &engine)
+    {
+        return exp(log_min + (log_max - log_min) * unit(engine));
+    };
+    double total_area = 0;
+    for (size_t i = 0; i < parameters.triangles; i++)
+    {
+        double size = next_size(random_engine);
+        total_area += size * size * sqrt(3.0) / 4.0;
+    }
+
+    // Square screen region sized so that the triangles cover it about `overdraw` times
+    double screen_area = (double)parameters.screen_width * parameters.screen_height;
+    double region_area = min(screen_area, total_area / max(parameters.overdraw, 1e-9));
+    double region_side = min(sqrt(region_area), (double)min(parameters.screen_width, parameters.screen_height));
+
+    // World units per pixel at the eye distance
+    double pixel_size = 2 * GENERATOR_EYE_DISTANCE * tan(GENERATOR_FOV_Y * PI / 360.0) / parameters.screen_height;
+    double region_half = region_side * pixel_size / 2.0;
+
+    size_t group_size = parameters.group_size;
+    for (size_t i = 0; i < parameters.triangles; i++)
+    {
+        bool group_start = parameters.nesting > 0 && i % group_size == 0;
+        bool group_end = parameters.nesting > 0 && (i % group_size == group_size - 1 || i + 1 == parameters.triangles);
+
+        // Identity transforms keep placement under control while exercising the matrix stack
+        if (group_start)
+            for (int level = 0; level < parameters.nesting; level++)
+            {
+                scene_stream << "push" << endl;
+                scene_stream << "translate" << endl;
+                scene_stream << "0.0 0.0 0.0" << endl;
+                scene_stream << "scale" << endl;
+                scene_stream << "1.0 1.0 1.0" << endl;
+            }
+
+        double cx = (2 * unit(random_engine) - 1) * region_half;
+        double cy = (2 * unit(random_engine) - 1) * region_half;
+        double cz = (2 * unit(random_engine) - 1) * GENERATOR_DEPTH_RANGE;
+        double radius = next_size(size_engine) * pixel_size / sqrt(3.0);
+        double phase = 2 * PI * unit(random_engine);
+
+        scene_stream << "triangle" << endl;
+        for (int v = 0; v < 3; v++)
+        {
+            double theta = phase + v * 2 * PI / 3;
+            scene_stream << cx + radius * cos(theta) << " " << cy + radius * sin(theta) << " " << cz << endl;
+        }
+
+        if (group_end)
+            for (int level = 0; level < parameters.nesting; level++)
+                scene_stream << "pop" << endl;
+    }
+    scene_stream << "end" << endl;
+
+    scene_stream.close();
+    config_stream.close();
+
+    return total_area / region_area;
+}
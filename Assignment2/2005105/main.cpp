@@ -1,125 +1,120 @@
-#include <stack>
-#include "rasterization.cpp"
+#include "session.cpp"
 
 using namespace std;
 
-int main(void)
+// Usage:
+//   main [--stats]                                        render scene.txt & config.txt of the current directory
+//   main batch [--threads N] [--mem-cap MB] [--stats] <dir|glob>...
+//                                                         render many scene directories in parallel
+//   main watch [--tile N] [--interval MS]                 re-render the current directory whenever scene.txt or
+//                                                         config.txt changes, redrawing only the affected tiles
+// --stats prints pipeline counters and stage timings as JSON, it needs a build with -DRASTER_STATS
+bool stats_available()
 {
-    // Input streams
-    ifstream scene_stream("scene.txt");
-
-    // Output streams
-    ofstream stage1_stream("stage1.txt");
-    ofstream stage2_stream("stage2.txt");
-    ofstream stage3_stream("stage3.txt");
-
-    // Output precisions
-    stage1_stream << fixed << setprecision(7);
-    stage2_stream << fixed << setprecision(7);
-    stage3_stream << fixed << setprecision(7);
-
-    // Input parameters
-    Vector eye, look, up;
-    double fovY, aspectRatio, near, far;
+#ifdef RASTER_STATS
+    return true;
+#else
+    cerr << "Statistics unavailable, rebuild with -DRASTER_STATS" << endl;
+    return false;
+#endif
+}
+
+int batch_main(int argc, char **argv)
+{
+    unsigned int num_threads = thread::hardware_concurrency();
+    size_t memory_cap = 0;
+    bool print_stats = false;
+    vector<string> arguments;
 
-    // Camera params from scene file
-    scene_stream >> eye >> look >> up >> fovY >> aspectRatio >> near >> far;
+    for (int i = 2; i < argc; i++)
+    {
+        string argument = argv[i];
+        if (argument == "--stats")
+            print_stats = stats_available();
+        else if (argument == "--threads" && i + 1 < argc)
+            num_threads = stoul(argv[++i]);
+        else if (argument == "--mem-cap" && i + 1 < argc)
+            memory_cap = stoull(argv[++i]) * 1024 * 1024;
+        else
+            arguments.push_back(argument);
+    }
 
-    stack<Matrix> s;
-    s.push(generateIdentityMatrix(4));
+    vector<string> directories = expand_scene_directories(arguments);
+    if (directories.empty())
+    {
+        cerr << "No scene directories given" << endl;
+        return -1;
+    }
 
-    vector<Triangle> triangles;
+    return render_batch(directories, num_threads, memory_cap, print_stats) ? -1 : 0;
+}
 
-    // Translation parameters
-    double tx, ty, tz;
-    // Scale parameters
-    double sx, sy, sz;
-    // Rotation parameters
-    double angle, rx, ry, rz;
+int watch_main(int argc, char **argv)
+{
+    int tile_size = 32, interval = 200;
+    for (int i = 2; i + 1 < argc; i++)
+    {
+        string argument = argv[i];
+        if (argument == "--tile")
+            tile_size = max(1, stoi(argv[++i]));
+        else if (argument == "--interval")
+            interval = max(1, stoi(argv[++i]));
+    }
 
-    // Modelling Transformation
-    string tx_command;
+    RenderSession session(".", tile_size);
+    filesystem::file_time_type scene_time, config_time;
+    cout << fixed << setprecision(3);
     while (true)
     {
-        scene_stream.ignore(256, '\n');
-        scene_stream >> tx_command;
-
-        if (tx_command == "triangle")
-        {
-            Triangle triangle;
-            scene_stream >> triangle;
-            triangle.transform(s.top());
-            triangles.push_back(triangle);
-            stage1_stream << triangle << endl;
-            stage1_stream << endl;
-        }
-        else if (tx_command == "translate")
-        {
-            scene_stream >> tx >> ty >> tz;
-            Matrix translation_matrix = translationMatrix(tx, ty, tz);
-            s.top() = s.top() * translation_matrix;
-        }
-        else if (tx_command == "scale")
-        {
-            scene_stream >> sx >> sy >> sz;
-            Matrix scaling_matrix = scalingMatrix(sx, sy, sz);
-            s.top() = s.top() * scaling_matrix;
-        }
-        else if (tx_command == "rotate")
-        {
-            scene_stream >> angle >> rx >> ry >> rz;
-            Matrix rotation_matrix = rotationMatrix(rx, ry, rz, angle);
-            s.top() = s.top() * rotation_matrix;
-        }
-        else if (tx_command == "push")
-        {
-            s.push(s.top());
-        }
-        else if (tx_command == "pop")
-        {
-            s.pop();
-        }
-        else if (tx_command == "end")
-        {
-            break;
-        }
-        else
+        error_code ec;
+        auto next_scene_time = filesystem::last_write_time("scene.txt", ec);
+        auto next_config_time = filesystem::last_write_time("config.txt", ec);
+        if (!ec && (next_scene_time != scene_time || next_config_time != config_time))
         {
-            cerr << "Invalid command: " << tx_command << endl;
-            return -1;
+            scene_time = next_scene_time, config_time = next_config_time;
+            try
+            {
+                SessionUpdate update = session.render();
+                cout << (update.full_render ? "Full render  " : "Incremental  ") << update.triangle_count << " triangles, "
+                     << update.changed_triangles << " changed, " << update.dirty_tiles << "/" << update.total_tiles
+                     << " tiles redrawn, " << update.seconds * 1000 << " ms" << endl;
+            }
+            catch (const exception &e)
+            {
+                cerr << e.what() << endl;
+            }
         }
+        this_thread::sleep_for(chrono::milliseconds(interval));
     }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && string(argv[1]) == "batch")
+        return batch_main(argc, argv);
+    if (argc > 1 && string(argv[1]) == "watch")
+        return watch_main(argc, argv);
+
+    bool print_stats = argc > 1 && string(argv[1]) == "--stats" && stats_available();
 
-    // View Transformation
-    Matrix view_matrix = viewMatrix(eye, look, up);
-    for (Triangle &triangle : triangles)
+    RenderReport report;
+    try
     {
-        triangle.transform(view_matrix);
-        stage2_stream << triangle << endl;
-        stage2_stream << endl;
+        render_scene(".", report);
     }
-
-    // Projection Transformation
-    Matrix projection_matrix = projectionMatrix(fovY, aspectRatio, near, far);
-    for (Triangle &triangle : triangles)
+    catch (const exception &e)
     {
-        triangle.transform(projection_matrix);
-        stage3_stream << triangle << endl;
-        stage3_stream << endl;
+        cerr << e.what() << endl;
+        return -1;
     }
 
-    // Clippinng & Rasterization
-    rasterization(triangles);
-
-    // Free all memory
-    triangles.clear();
-
-    // All file streams closed
-    scene_stream.close();
-
-    stage1_stream.close();
-    stage2_stream.close();
-    stage3_stream.close();
+#ifdef RASTER_STATS
+    if (print_stats)
+        cout << report.stats << endl;
+#else
+    (void)print_stats;
+#endif
 
     return 0;
-}
\ No newline at end of file
+}
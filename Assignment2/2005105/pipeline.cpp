@@ -0,0 +1,583 @@
+#include <stack>
+#include <chrono>
+#include <stdexcept>
+
+#include "tessellation.cpp"
+
+using namespace std;
+
+class RenderReport
+{
+public:
+    string directory;
+    size_t triangle_count = 0;
+    double seconds = 0;
+    bool success = false;
+    string error;
+#ifdef RASTER_STATS
+    RenderStats stats;
+#endif
+};
+
+// Rough heap footprint of one scene triangle (3 homogeneous 4x1 matrices)
+size_t triangle_footprint()
+{
+    size_t matrix_bytes = sizeof(Matrix) + 4 * (sizeof(vector<double>) + sizeof(double));
+    return sizeof(Triangle) + 3 * matrix_bytes;
+}
+
+// Rough heap footprint of one frame for a configuration: the rasterizer's sample depths and colors, the
+// A-buffer pool with its per-sample list heads, and the resolved z-buffer and image
+size_t frame_footprint(const RasterConfig &config)
+{
+    size_t width = config.screen_width, height = config.screen_height;
+    size_t samples = width * height * config.samples;
+    size_t sample_bytes = samples * (sizeof(double) + 3);
+    size_t abuffer_bytes = config.abuffer_fragments ? config.abuffer_fragments * (sizeof(double) + sizeof(float) + sizeof(int) + 4) + samples * sizeof(int) : 0;
+    return sample_bytes + abuffer_bytes + height * (sizeof(vector<double>) + width * sizeof(double)) + width * height * 3;
+}
+
+size_t view_count(const RasterConfig &config)
+{
+    return config.view_mode == ViewMode::STEREO ? 2 : config.view_mode == ViewMode::CUBE ? 6 : 1;
+}
+
+// Copies of every scene triangle a render holds: a single view transforms them in place, a multi-view render
+// keeps the world space ones and a projected copy per view. A light adds its light space copy.
+size_t triangle_copies(const RasterConfig &config, bool light)
+{
+    size_t views = view_count(config);
+    return (views == 1 ? 1 : 1 + views) + light;
+}
+
+// Rough heap footprint of a whole render of triangles scene triangles
+size_t render_footprint(const RasterConfig &config, size_t triangles, bool light)
+{
+    size_t bytes = view_count(config) * frame_footprint(config) + triangles * triangle_copies(config, light) * triangle_footprint();
+    if (light)
+    {
+        RasterConfig light_config;
+        light_config.screen_width = light_config.screen_height = config.shadow_resolution;
+        light_config.samples = config.samples;
+        bytes += frame_footprint(light_config);
+    }
+    return bytes;
+}
+
+// Most scene triangles modelling may emit under memory_cap (0 for no cap), before the scene's light is known
+size_t max_scene_triangles(const RasterConfig &config, size_t memory_cap)
+{
+    if (!memory_cap)
+        return numeric_limits<size_t>::max();
+    if (render_footprint(config, 0, false) > memory_cap)
+        throw runtime_error("Frame buffers exceed memory cap");
+    return (memory_cap - render_footprint(config, 0, false)) / (triangle_copies(config, false) * triangle_footprint());
+}
+
+// Once the scene is modelled the light is known, its copy and shadow map count too
+void check_memory_cap(const RasterConfig &config, size_t triangles, bool light, size_t memory_cap)
+{
+    if (memory_cap && render_footprint(config, triangles, light) > memory_cap)
+        throw runtime_error("Scene with its light exceeds memory cap at " + to_string(triangles) + " triangles");
+}
+
+class Camera
+{
+public:
+    Vector eye, look, up;
+    double fovY, aspectRatio, near, far;
+
+    // View followed by projection
+    Matrix matrix() const
+    {
+        Matrix view = viewMatrix(eye, look, up);
+        return projectionMatrix(fovY, aspectRatio, near, far) * view;
+    }
+
+    friend istream &operator>>(istream &input_stream, Camera &camera)
+    {
+        return input_stream >> camera.eye >> camera.look >> camera.up >> camera.fovY >> camera.aspectRatio >> camera.near >> camera.far;
+    }
+};
+
+// What transform_scene finds in scene.txt besides the projected triangles
+class SceneInfo
+{
+public:
+    Camera camera;
+    vector<TriangleGroup> groups;
+    SceneLight light;
+    // Scene triangles in the light's clip space, cut at its near plane, only filled when the scene has a light
+    vector<Triangle> light_triangles;
+};
+
+// Stage 1: runs the scene commands after the camera line and emits world space triangles.
+// groups receives the triangle range of every push/pop pair in push order. view sets the
+// tessellation of the primitive commands, each followed by its center:
+//   sphere <x y z> <radius>
+//   cylinder <x y z> <radius> <height>           capped, along the y axis
+//   torus <x y z> <major radius> <minor radius>  around the y axis
+// light receives the last "light <position> <look> <fovY near far>" command, placed by the current transform.
+// "alpha <0..1>" sets the opacity of the triangles that follow, push/pop save and restore it with the transform.
+// "colored_triangle" is a triangle with a color per vertex, each line "x y z r g b" with channels in 0..255.
+void model_scene(istream &scene_stream, vector<Triangle> &triangles, ostream &stage1_stream,
+                 size_t max_triangles = numeric_limits<size_t>::max(), vector<TriangleGroup> *groups = nullptr,
+                 const TessellationView &view = TessellationView(), SceneLight *light = nullptr)
+{
+    stack<Matrix> s;
+    s.push(generateIdentityMatrix(4));
+    stack<double> alphas;
+    alphas.push(1);
+    stack<size_t> open_groups;
+
+    // Translation parameters
+    double tx, ty, tz;
+    // Scale parameters
+    double sx, sy, sz;
+    // Rotation parameters
+    double angle, rx, ry, rz;
+    // Primitive parameters
+    Vector center;
+    double radius, height, minor_radius;
+
+    auto emit = [&](Triangle &triangle)
+    {
+        if (triangles.size() == max_triangles)
+            throw runtime_error("Scene exceeds memory cap after " + to_string(max_triangles) + " triangles");
+
+        triangle.transform(s.top());
+        triangle.alpha = alphas.top();
+        triangles.push_back(triangle);
+        stage1_stream << triangle << endl;
+        stage1_stream << endl;
+    };
+
+    // Modelling Transformation
+    string tx_command;
+    while (true)
+    {
+        scene_stream.ignore(256, '\n');
+        scene_stream >> tx_command;
+
+        if (tx_command == "triangle")
+        {
+            Triangle triangle;
+            scene_stream >> triangle;
+            emit(triangle);
+        }
+        else if (tx_command == "colored_triangle")
+        {
+            Triangle triangle;
+            triangle.attributes.resize(9);
+            for (int i = 0; i < 3; i++)
+            {
+                Matrix &v = triangle.vertices[i];
+                scene_stream >> v.elements[0][0] >> v.elements[1][0] >> v.elements[2][0];
+                scene_stream >> triangle.attributes[i * 3] >> triangle.attributes[i * 3 + 1] >> triangle.attributes[i * 3 + 2];
+            }
+            emit(triangle);
+        }
+        else if (tx_command == "sphere")
+        {
+            scene_stream >> center >> radius;
+            for (Triangle &triangle : tessellate_sphere(center, radius, view.segments(s.top(), center, radius)))
+                emit(triangle);
+        }
+        else if (tx_command == "cylinder")
+        {
+            scene_stream >> center >> radius >> height;
+            for (Triangle &triangle : tessellate_cylinder(center, radius, height, view.segments(s.top(), center, radius)))
+                emit(triangle);
+        }
+        else if (tx_command == "torus")
+        {
+            scene_stream >> center >> radius >> minor_radius;
+            for (Triangle &triangle : tessellate_torus(center, radius, minor_radius, view.segments(s.top(), center, radius + minor_radius),
+                                                       view.segments(s.top(), center, minor_radius)))
+                emit(triangle);
+        }
+        else if (tx_command == "translate")
+        {
+            scene_stream >> tx >> ty >> tz;
+            Matrix translation_matrix = translationMatrix(tx, ty, tz);
+            s.top() = s.top() * translation_matrix;
+        }
+        else if (tx_command == "scale")
+        {
+            scene_stream >> sx >> sy >> sz;
+            Matrix scaling_matrix = scalingMatrix(sx, sy, sz);
+            s.top() = s.top() * scaling_matrix;
+        }
+        else if (tx_command == "rotate")
+        {
+            scene_stream >> angle >> rx >> ry >> rz;
+            Matrix rotation_matrix = rotationMatrix(rx, ry, rz, angle);
+            s.top() = s.top() * rotation_matrix;
+        }
+        else if (tx_command == "light")
+        {
+            SceneLight scene_light;
+            scene_stream >> scene_light.position >> scene_light.look >> scene_light.fovY >> scene_light.near >> scene_light.far;
+            Triangle placement;
+            placement.vertices[0].elements = {{scene_light.position.x}, {scene_light.position.y}, {scene_light.position.z}, {1}};
+            placement.vertices[1].elements = {{scene_light.look.x}, {scene_light.look.y}, {scene_light.look.z}, {1}};
+            placement.transform(s.top());
+            scene_light.position = Vector(placement.vertices[0].elements[0][0], placement.vertices[0].elements[1][0], placement.vertices[0].elements[2][0]);
+            scene_light.look = Vector(placement.vertices[1].elements[0][0], placement.vertices[1].elements[1][0], placement.vertices[1].elements[2][0]);
+            scene_light.enabled = true;
+            if (light)
+                *light = scene_light;
+        }
+        else if (tx_command == "alpha")
+        {
+            double alpha;
+            scene_stream >> alpha;
+            if (!scene_stream || alpha < 0 || alpha > 1)
+                throw invalid_argument("Alpha must be between 0 and 1");
+            alphas.top() = alpha;
+        }
+        else if (tx_command == "push")
+        {
+            s.push(s.top());
+            alphas.push(alphas.top());
+            if (groups)
+            {
+                open_groups.push(groups->size());
+                groups->push_back(TriangleGroup{triangles.size(), triangles.size()});
+            }
+        }
+        else if (tx_command == "pop")
+        {
+            s.pop();
+            alphas.pop();
+            if (groups && !open_groups.empty())
+            {
+                (*groups)[open_groups.top()].end = triangles.size();
+                open_groups.pop();
+            }
+        }
+        else if (tx_command == "end")
+        {
+            // Unbalanced pushes extend to the end of the scene
+            for (; !open_groups.empty(); open_groups.pop())
+                (*groups)[open_groups.top()].end = triangles.size();
+            break;
+        }
+        else
+        {
+            throw invalid_argument("Invalid command: " + tx_command);
+        }
+    }
+}
+
+// Stage 2 & 3: applies the view or projection matrix and emits the transformed triangles
+void transform_triangles(vector<Triangle> &triangles, const Matrix &matrix, ostream &stage_stream)
+{
+    for (Triangle &triangle : triangles)
+    {
+        triangle.transform(matrix);
+        stage_stream << triangle << endl;
+        stage_stream << endl;
+    }
+}
+
+// Clips a view space triangle to the near plane z = -near and appends the 0 to 2 triangles in front of it.
+// Views around the scene and the light of the shadow pass see triangles behind their eye, which the
+// projection would fold onto the screen.
+void clip_near_plane(const Triangle &triangle, double near, vector<Triangle> &clipped)
+{
+    double distance[3];
+    int inside = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        distance[k] = -triangle.vertices[k].elements[2][0] - near;
+        inside += distance[k] >= 0;
+    }
+    if (inside == 3)
+    {
+        clipped.push_back(triangle);
+        return;
+    }
+
+    // Vertex attributes are affine in view space and are cut like the positions
+    int count = triangle.attributes.size() / 3;
+    vector<Matrix> polygon;
+    vector<vector<double>> polygon_attributes;
+    for (int k = 0; k < 3; k++)
+    {
+        int next = (k + 1) % 3;
+        vector<double> attributes(triangle.attributes.begin() + k * count, triangle.attributes.begin() + (k + 1) * count);
+        if (distance[k] >= 0)
+            polygon.push_back(triangle.vertices[k]), polygon_attributes.push_back(attributes);
+        if ((distance[k] >= 0) != (distance[next] >= 0))
+        {
+            double t = distance[k] / (distance[k] - distance[next]);
+            Matrix point = triangle.vertices[k];
+            for (int r = 0; r < 3; r++)
+                point.elements[r][0] += t * (triangle.vertices[next].elements[r][0] - triangle.vertices[k].elements[r][0]);
+            for (int a = 0; a < count; a++)
+                attributes[a] += t * (triangle.attributes[next * count + a] - attributes[a]);
+            polygon.push_back(point), polygon_attributes.push_back(attributes);
+        }
+    }
+
+    // Fan keeps the winding of the triangle
+    for (size_t k = 1; k + 1 < polygon.size(); k++)
+    {
+        Triangle piece = triangle;
+        piece.vertices = {polygon[0], polygon[k], polygon[k + 1]};
+        piece.attributes.clear();
+        for (size_t corner : {(size_t)0, k, k + 1})
+            piece.attributes.insert(piece.attributes.end(), polygon_attributes[corner].begin(), polygon_attributes[corner].end());
+        clipped.push_back(piece);
+    }
+}
+
+// Runs the modelling stage of a directory's scene.txt into world space triangles and writes stage1.txt.
+// info receives the camera, push/pop groups and light; screen_height sizes the tessellation of primitives.
+Camera model_scene_file(const string &directory, vector<Triangle> &triangles,
+                        size_t max_triangles = numeric_limits<size_t>::max(), SceneInfo *info = nullptr,
+                        double screen_height = 0)
+{
+    // Input streams
+    ifstream scene_stream(directory + "/scene.txt");
+    if (!scene_stream.is_open())
+        throw invalid_argument("Unable to open " + directory + "/scene.txt");
+
+    // Output streams
+    ofstream stage1_stream(directory + "/stage1.txt");
+    stage1_stream << fixed << setprecision(7);
+
+    // Camera params from scene file
+    Camera camera;
+    scene_stream >> camera;
+
+    // Modelling Transformation
+    {
+        STATS_TIME(parsing);
+        model_scene(scene_stream, triangles, stage1_stream, max_triangles, info ? &info->groups : nullptr,
+                    TessellationView(camera.eye, camera.fovY, screen_height), info ? &info->light : nullptr);
+    }
+
+    if (info)
+        info->camera = camera;
+
+    // Light space copy for the shadow pass, clipped in the light's view space before the projection divides by w
+    if (info && info->light.enabled)
+    {
+        STATS_TIME(shadow);
+        Matrix light_view = info->light.view(), light_projection = info->light.projection();
+        for (Triangle triangle : triangles)
+        {
+            triangle.transform(light_view);
+            triangle.red = triangle.green = triangle.blue = 255;
+            triangle.attributes.clear();
+            clip_near_plane(triangle, info->light.near, info->light_triangles);
+        }
+        for (Triangle &triangle : info->light_triangles)
+            triangle.transform(light_projection);
+    }
+
+    // All file streams closed
+    scene_stream.close();
+    stage1_stream.close();
+
+    return camera;
+}
+
+// Runs the modelling, view and projection stages of a directory's scene.txt and writes the stage files.
+// info receives the camera, push/pop groups and light; screen_height sizes the tessellation of primitives.
+void transform_scene(const string &directory, vector<Triangle> &triangles,
+                     size_t max_triangles = numeric_limits<size_t>::max(), SceneInfo *info = nullptr,
+                     double screen_height = 0)
+{
+    Camera camera = model_scene_file(directory, triangles, max_triangles, info, screen_height);
+
+    // Output streams
+    ofstream stage2_stream(directory + "/stage2.txt");
+    ofstream stage3_stream(directory + "/stage3.txt");
+
+    // Output precisions
+    stage2_stream << fixed << setprecision(7);
+    stage3_stream << fixed << setprecision(7);
+
+    // View Transformation
+    {
+        STATS_TIME(view);
+        transform_triangles(triangles, viewMatrix(camera.eye, camera.look, camera.up), stage2_stream);
+    }
+
+    // Projection Transformation
+    {
+        STATS_TIME(projection);
+        transform_triangles(triangles, projectionMatrix(camera.fovY, camera.aspectRatio, camera.near, camera.far), stage3_stream);
+    }
+
+    // All file streams closed
+    stage2_stream.close();
+    stage3_stream.close();
+}
+
+// A camera of a multi-view render and the suffix of its output files
+class SceneView
+{
+public:
+    string name;
+    Camera camera;
+};
+
+// The stereo pair or cube map faces of the scene camera. Stereo eyes are moved apart along the camera's right
+// vector and keep its direction; cube faces look along the axes from the camera's eye with a 90 degree square
+// frustum, up vectors as in the usual cube map face layout.
+vector<SceneView> scene_views(const Camera &camera, const RasterConfig &config)
+{
+    vector<SceneView> views;
+    if (config.view_mode == ViewMode::STEREO)
+    {
+        Vector right = (camera.look - camera.eye).cross(camera.up).normalize() * (config.eye_separation / 2);
+        views.push_back(SceneView{"_left", camera});
+        views.push_back(SceneView{"_right", camera});
+        views[0].camera.eye = camera.eye - right, views[0].camera.look = camera.look - right;
+        views[1].camera.eye = camera.eye + right, views[1].camera.look = camera.look + right;
+    }
+    else if (config.view_mode == ViewMode::CUBE)
+    {
+        const string names[6] = {"_px", "_nx", "_py", "_ny", "_pz", "_nz"};
+        const Vector directions[6] = {Vector(1, 0, 0), Vector(-1, 0, 0), Vector(0, 1, 0), Vector(0, -1, 0), Vector(0, 0, 1), Vector(0, 0, -1)};
+        const Vector ups[6] = {Vector(0, -1, 0), Vector(0, -1, 0), Vector(0, 0, 1), Vector(0, 0, -1), Vector(0, -1, 0), Vector(0, -1, 0)};
+        for (int face = 0; face < 6; face++)
+        {
+            Camera face_camera = camera;
+            face_camera.look = camera.eye + directions[face], face_camera.up = ups[face];
+            face_camera.fovY = 90, face_camera.aspectRatio = 1;
+            views.push_back(SceneView{names[face], face_camera});
+        }
+    }
+    else
+        views.push_back(SceneView{"", camera});
+    return views;
+}
+
+// View and projection stages of one view over shared world space triangles, groups follow the clipped triangles
+void project_view(const vector<Triangle> &world, const vector<TriangleGroup> &groups, const Camera &camera, ViewFrame &frame)
+{
+    vector<size_t> first_piece(world.size() + 1);
+    {
+        STATS_TIME(view);
+        Matrix view = viewMatrix(camera.eye, camera.look, camera.up);
+        for (size_t i = 0; i < world.size(); i++)
+        {
+            first_piece[i] = frame.triangles.size();
+            Triangle triangle = world[i];
+            triangle.transform(view);
+            clip_near_plane(triangle, camera.near, frame.triangles);
+        }
+        first_piece[world.size()] = frame.triangles.size();
+    }
+
+    for (const TriangleGroup &group : groups)
+        frame.groups.push_back(TriangleGroup{first_piece[group.begin], first_piece[group.end]});
+
+    STATS_TIME(projection);
+    Matrix projection = projectionMatrix(camera.fovY, camera.aspectRatio, camera.near, camera.far);
+    for (Triangle &triangle : frame.triangles)
+        triangle.transform(projection);
+}
+
+// Multi-view render (views stereo|cube): the scene is modelled and colored once, then every view projects the
+// shared world space triangles and all views are rasterized together. Each view writes out_<view>.bmp and
+// z_buffer_<view>.txt; stage2.txt and stage3.txt belong to a single camera and are not written.
+size_t render_views(const string &directory, const RasterConfig &config, size_t memory_cap, unsigned int num_threads)
+{
+    vector<Triangle> world;
+    SceneInfo scene;
+    model_scene_file(directory, world, max_scene_triangles(config, memory_cap), &scene, config.screen_height);
+    check_memory_cap(config, world.size(), scene.light.enabled, memory_cap);
+
+    // A triangle has the same color in every view
+    for (Triangle &triangle : world)
+        triangle.set_random_colors();
+
+    vector<SceneView> views = scene_views(scene.camera, config);
+    vector<ViewFrame> frames(views.size());
+    for (size_t v = 0; v < views.size(); v++)
+        project_view(world, scene.groups, views[v].camera, frames[v]);
+
+    rasterize_views(frames, config, num_threads);
+
+    ShadowMap shadow_map;
+    if (scene.light.enabled)
+    {
+        STATS_TIME(shadow);
+        shadow_map = render_shadow_map(scene.light_triangles, scene.light, config);
+    }
+    for (size_t v = 0; v < views.size(); v++)
+    {
+        if (scene.light.enabled)
+        {
+            STATS_TIME(shadow);
+            apply_shadows(frames[v].z_buffer, frames[v].image, config, views[v].camera.matrix(), shadow_map);
+        }
+        save_outputs(frames[v].z_buffer, frames[v].image, config, directory, views[v].name);
+    }
+    return world.size();
+}
+
+// Single camera render: stage files, z_buffer.txt and out.bmp, returns the number of scene triangles
+size_t render_single_view(const string &directory, const RasterConfig &config, size_t memory_cap)
+{
+    vector<Triangle> triangles;
+    SceneInfo scene;
+    transform_scene(directory, triangles, max_scene_triangles(config, memory_cap), &scene, config.screen_height);
+    check_memory_cap(config, triangles.size(), scene.light.enabled, memory_cap);
+
+    // Clippinng & Rasterization
+    vector<vector<double>> z_buffer;
+    bitmap_image image;
+    rasterize(triangles, config, z_buffer, image, scene.groups);
+
+    // Shadowed lighting from the scene's light
+    if (scene.light.enabled)
+    {
+        STATS_TIME(shadow);
+        ShadowMap shadow_map = render_shadow_map(scene.light_triangles, scene.light, config);
+        apply_shadows(z_buffer, image, config, scene.camera.matrix(), shadow_map);
+    }
+
+    save_outputs(z_buffer, image, config, directory);
+
+    // Free all memory
+    size_t triangle_count = triangles.size();
+    triangles.clear();
+    return triangle_count;
+}
+
+// Renders scene.txt/config.txt of a directory and writes stage files, z_buffer.txt and out.bmp next to them
+// (one pair per view with "views stereo|cube").
+// A non-zero memory_cap (bytes) aborts the job once its estimated footprint exceeds the cap.
+// num_threads is the job's thread budget, multi-view renders rasterize their views on that many threads.
+void render_scene(const string &directory, RenderReport &report, size_t memory_cap = 0,
+                  unsigned int num_threads = thread::hardware_concurrency())
+{
+    auto start_time = chrono::steady_clock::now();
+    report.directory = directory;
+
+    // Every scene gets the same color sequence regardless of what rendered before it
+    fastrand_seed();
+
+    STATS_RESET();
+
+    RasterConfig config = read_raster_config(directory + "/config.txt");
+    if (config.view_mode == ViewMode::SINGLE)
+        report.triangle_count = render_single_view(directory, config, memory_cap);
+    else
+        report.triangle_count = render_views(directory, config, memory_cap, num_threads);
+
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    report.success = true;
+
+    STATS_ADD(total_seconds, report.seconds);
+#ifdef RASTER_STATS
+    report.stats = render_stats;
+#endif
+}
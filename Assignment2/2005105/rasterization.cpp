@@ -1,148 +1,1047 @@
 #include <fstream>
 #include <iomanip>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <atomic>
+#include <thread>
 
 #include "transformations.cpp"
 #include "bitmap_image.hpp"
+#include "stats.cpp"
 
 using namespace std;
 
-bool is_equal(double a, double b) { return fabs(a - b) <= numeric_limits<double>::epsilon(); }
+template <typename Scalar>
+bool is_equal(Scalar a, Scalar b) { return fabs(a - b) <= numeric_limits<Scalar>::epsilon(); }
 
-pair<bool, Point> check_line_segment_intersection(const Line &line, Line segment)
+enum class CullMode
 {
-    pair<bool, Point> intersection_point = line.get_intersection_point(segment);
-    // No intersection
-    if (!intersection_point.first)
-        return intersection_point;
+    NONE,
+    BACK,
+    FRONT
+};
 
-    // Checking if the line segment is vertical
-    if (is_equal(segment.p0.x, segment.p1.x))
-        // If yes, comparing if intersection point is bound by y-coordinates of line segment
-        intersection_point.first = intersection_point.second.y >= min(segment.p0.y, segment.p1.y) && intersection_point.second.y <= max(segment.p0.y, segment.p1.y);
-    else
-        // Otherwise, comparing if intersection point is bound by y-coordinates of line segment
-        intersection_point.first = intersection_point.second.x >= min(segment.p0.x, segment.p1.x) && intersection_point.second.x <= max(segment.p0.x, segment.p1.x);
+// Cameras rendered from one scene: the scene camera, a stereo pair around it or the six faces of a cube map at its eye
+enum class ViewMode
+{
+    SINGLE,
+    STEREO,
+    CUBE
+};
+
+// Most plane equations a compressed depth tile holds before it falls back to one depth per sample
+constexpr int MAX_DEPTH_PLANES = 4;
+
+// Most per-vertex attributes a triangle can carry
+constexpr int MAX_VERTEX_ATTRIBUTES = 8;
+
+// Largest A-buffer fragment pool a config may ask for
+constexpr int MAX_ABUFFER_FRAGMENTS = 1 << 26;
 
-    return intersection_point;
+// Parses a finite number greater than zero
+bool parse_positive(const string &value, double &result)
+{
+    char *end;
+    double parsed = strtod(value.c_str(), &end);
+    if (value.empty() || *end != '\0' || !isfinite(parsed) || parsed <= 0)
+        return false;
+    result = parsed;
+    return true;
 }
 
-void rasterization(vector<Triangle> &triangles)
+class RasterConfig
 {
-    // Input streams
-    ifstream config_stream("config.txt");
+public:
+    double screen_width, screen_height;
+    double left_limit, right_limit;
+    double bottom_limit, top_limit;
+    double z_min, z_max;
 
-    // Output streams
-    ofstream z_buffer_stream("z_buffer.txt");
-    z_buffer_stream << fixed << setprecision(6);
+    // Optional "key value" lines after the depth range select the rasterizer specialization
+    bool single_precision = false;
+    string depth_format = "float64";
+    CullMode cull_mode = CullMode::NONE;
+    int samples = 1;
+    int depth_planes = 0;
+    bool span_buffer = false;
+    bool occlusion_culling = false;
 
-    // Sub-task-1: Read & Extract Data
-    double screen_width, screen_height;
-    config_stream >> screen_width >> screen_height;
+    // Shadow map resolution and percentage closer filtering kernel, used when the scene has a light
+    int shadow_resolution = 1024;
+    int shadow_pcf = 3;
 
-    // Horizontal limits of the view space
-    double left_limit, right_limit;
-    config_stream >> left_limit;
-    right_limit = (-1) * left_limit;
+    // A-buffer fragment pool size (0 treats every triangle as opaque) and whether a fragment that finds the
+    // pool exhausted is merged into the sample's nearest-in-depth fragment instead of being dropped
+    int abuffer_fragments = 0;
+    bool abuffer_merge = false;
 
-    // Vertical limits of the view space
-    double bottom_limit, top_limit;
-    config_stream >> bottom_limit;
-    top_limit = (-1) * bottom_limit;
+    // Views rendered in one pass and the distance between the eyes of a stereo pair
+    ViewMode view_mode = ViewMode::SINGLE;
+    double eye_separation = 1;
 
-    // Depth range
-    double z_min, z_max;
-    config_stream >> z_min >> z_max;
+    friend istream &operator>>(istream &input_stream, RasterConfig &config)
+    {
+        input_stream >> config.screen_width >> config.screen_height;
 
-    for (Triangle &triangle : triangles)
-        triangle.set_random_colors();
+        // Horizontal limits of the view space
+        input_stream >> config.left_limit;
+        config.right_limit = (-1) * config.left_limit;
+
+        // Vertical limits of the view space
+        input_stream >> config.bottom_limit;
+        config.top_limit = (-1) * config.bottom_limit;
+
+        // Depth range
+        input_stream >> config.z_min >> config.z_max;
+
+        string key, value;
+        while (input_stream >> key >> value)
+        {
+            if (key == "precision" && (value == "float" || value == "double"))
+                config.single_precision = value == "float";
+            else if (key == "depth" && (value == "float64" || value == "float32" || value == "unorm24"))
+                config.depth_format = value;
+            else if (key == "cull" && (value == "none" || value == "back" || value == "front"))
+                config.cull_mode = value == "back" ? CullMode::BACK : value == "front" ? CullMode::FRONT : CullMode::NONE;
+            else if (key == "samples" && (value == "1" || value == "4"))
+                config.samples = stoi(value);
+            else if (key == "depth_compression" && value.size() == 1 && value[0] >= '0' && value[0] - '0' <= MAX_DEPTH_PLANES)
+                config.depth_planes = value[0] - '0';
+            else if (key == "visibility" && (value == "zbuffer" || value == "spans"))
+                config.span_buffer = value == "spans";
+            else if (key == "occlusion" && (value == "on" || value == "off"))
+                config.occlusion_culling = value == "on";
+            else if (key == "shadow_map" && value.find_first_not_of("0123456789") == string::npos &&
+                     value.size() <= 5 && stoi(value) >= 16 && stoi(value) <= 16384)
+                config.shadow_resolution = stoi(value);
+            else if (key == "shadow_pcf" && (value == "1" || value == "3" || value == "5" || value == "7" || value == "9"))
+                config.shadow_pcf = stoi(value);
+            else if (key == "abuffer" && value.find_first_not_of("0123456789") == string::npos &&
+                     value.size() <= 8 && stoi(value) <= MAX_ABUFFER_FRAGMENTS)
+                config.abuffer_fragments = stoi(value);
+            else if (key == "abuffer_overflow" && (value == "drop" || value == "merge"))
+                config.abuffer_merge = value == "merge";
+            else if (key == "views" && (value == "single" || value == "stereo" || value == "cube"))
+                config.view_mode = value == "stereo" ? ViewMode::STEREO : value == "cube" ? ViewMode::CUBE : ViewMode::SINGLE;
+            else if (key == "eye_separation" && parse_positive(value, config.eye_separation))
+                ;
+            else
+                throw invalid_argument("Invalid config option: " + key + " " + value);
+        }
+        return input_stream;
+    }
+};
+
+RasterConfig read_raster_config(const string &config_path)
+{
+    ifstream config_stream(config_path);
+    if (!config_stream.is_open())
+        throw invalid_argument("Unable to open " + config_path);
+
+    RasterConfig config;
+    config_stream >> config;
+    config_stream.close();
+    return config;
+}
+
+// Depth buffer storage formats, each maps view depth to a comparable stored value and back
+class DepthFloat64
+{
+public:
+    typedef double Storage;
+    DepthFloat64(const RasterConfig &) {}
+    Storage encode(double z) const { return z; }
+    double decode(Storage stored) const { return stored; }
+};
+
+class DepthFloat32
+{
+public:
+    typedef float Storage;
+    DepthFloat32(const RasterConfig &) {}
+    Storage encode(double z) const { return z; }
+    double decode(Storage stored) const { return stored; }
+};
+
+// 24-bit fixed point over [z_min, z_max], depths beyond z_max saturate to the cleared value
+class DepthUnorm24
+{
+public:
+    typedef uint32_t Storage;
+    static constexpr double MAX_CODE = (1 << 24) - 1;
+    double z_min, scale;
+
+    DepthUnorm24(const RasterConfig &config) : z_min(config.z_min), scale(MAX_CODE / (config.z_max - config.z_min)) {}
+    Storage encode(double z) const { return min(MAX_CODE, max(0.0, round((z - z_min) * scale))); }
+    double decode(Storage stored) const { return z_min + stored / scale; }
+};
+
+// Scanline y = current_y against segment (x0, y0)-(x1, y1).
+// Same arithmetic as Line::get_intersection_point with a horizontal line, so double results match it bit for bit;
+// like it, x is still reported when the crossing lies outside the segment.
+template <typename Scalar>
+pair<bool, Scalar> scanline_crossing(Scalar x0, Scalar y0, Scalar x1, Scalar y1, Scalar current_y)
+{
+    Scalar dx = x1 - x0, dy = y1 - y0;
+
+    // Parallel / Coincident
+    Scalar perp_vector_square = dy * dy;
+    if (fabs(perp_vector_square) <= numeric_limits<Scalar>::epsilon())
+        return make_pair(false, Scalar(0));
+
+    Scalar x = ((x0 * dy - dx * (y0 - current_y)) * dy) / perp_vector_square;
+
+    // Vertical segments are bound by y-coordinates, others by x-coordinates
+    if (is_equal(x0, x1))
+        return make_pair(current_y >= min(y0, y1) && current_y <= max(y0, y1), x);
+    return make_pair(x >= min(x0, x1) && x <= max(x0, x1), x);
+}
 
-    // Size of a pixel in normalized coordinates
-    double pixel_width = (right_limit - left_limit) / screen_width;
-    double pixel_height = (top_limit - bottom_limit) / screen_height;
+// Inclusive pixel rectangle, rows counted from the top of the image
+class PixelRect
+{
+public:
+    int left, top, right, bottom;
 
-    // Center coordinates of edge pixels
-    double topmost_center_y = top_limit - pixel_height / 2.0;
-    double bottommost_center_y = bottom_limit + pixel_height / 2.0;
-    double leftmost_center_x = left_limit + pixel_width / 2.0;
-    double rightmost_center_x = right_limit - pixel_width / 2.0;
+    PixelRect(int left = 0, int top = 0, int right = -1, int bottom = -1) : left(left), top(top), right(right), bottom(bottom) {}
 
-    // Sub-task-2: Initialize Z-buffer and Frame buffer
-    vector<vector<double>> z_buffer(screen_height, vector<double>(screen_width, z_max));
-    bitmap_image image(screen_width, screen_height);
-    image.set_all_channels(0, 0, 0);
+    bool empty() const { return left > right || top > bottom; }
 
-    // Sub-task-3: Apply procedure
-    for (int tr = 0; tr < triangles.size(); tr++)
+    bool overlaps(const PixelRect &other) const
     {
-        Triangle triangle = triangles[tr];
-        triangle.reorder_vertices();
+        return !empty() && !other.empty() && left <= other.right && other.left <= right &&
+               top <= other.bottom && other.top <= bottom;
+    }
+};
 
-        // Trianle vertices -> A, B, C
-        auto toVector = [](const Matrix &m)
+PixelRect screen_rect(const RasterConfig &config)
+{
+    return PixelRect(0, 0, config.screen_width - 1, config.screen_height - 1);
+}
+
+// Triangles [begin, end) of the scene emitted between a push and its pop
+class TriangleGroup
+{
+public:
+    size_t begin, end;
+};
+
+// Perspective-correct interpolation of per-vertex attributes. Every attribute divided by w, and 1/w itself, is
+// affine in screen space, so setup fits a plane v = a + b * x + c * y to each of them once per triangle.
+// Plane 0 is 1/w, plane k + 1 is attribute k over w.
+class AttributeSetup
+{
+public:
+    int count;
+    double a[MAX_VERTEX_ATTRIBUTES + 1], b[MAX_VERTEX_ATTRIBUTES + 1], c[MAX_VERTEX_ATTRIBUTES + 1];
+
+    AttributeSetup(const Triangle &triangle)
+    {
+        count = triangle.attributes.size() / 3;
+        if (count > MAX_VERTEX_ATTRIBUTES)
+            throw invalid_argument("Too many vertex attributes");
+
+        double x[3], y[3];
+        for (int i = 0; i < 3; i++)
+            x[i] = triangle.vertices[i].elements[0][0], y[i] = triangle.vertices[i].elements[1][0];
+        double area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+
+        for (int k = 0; k <= count; k++)
+        {
+            double v[3];
+            for (int i = 0; i < 3; i++)
+                v[i] = (k ? triangle.attributes[i * count + k - 1] : 1) * triangle.inverse_w[i];
+
+            // Edge-on triangles keep the first vertex's values
+            if (fabs(area) <= numeric_limits<double>::epsilon())
+                b[k] = c[k] = 0;
+            else
+            {
+                b[k] = ((v[1] - v[0]) * (y[2] - y[0]) - (v[2] - v[0]) * (y[1] - y[0])) / area;
+                c[k] = ((x[1] - x[0]) * (v[2] - v[0]) - (x[2] - x[0]) * (v[1] - v[0])) / area;
+            }
+            a[k] = v[0] - b[k] * x[0] - c[k] * y[0];
+        }
+    }
+};
+
+// The attribute planes along one row of samples. Moving to the next column adds each plane's x step,
+// so a span costs one addition per attribute and one division per sample.
+class AttributeSpan
+{
+    const AttributeSetup &setup;
+    double y, first_x, step_x;
+    int column = -2;
+    double values[MAX_VERTEX_ATTRIBUTES + 1], steps[MAX_VERTEX_ATTRIBUTES + 1];
+
+public:
+    AttributeSpan(const AttributeSetup &setup, double y, double first_x, double step_x)
+        : setup(setup), y(y), first_x(first_x), step_x(step_x)
+    {
+        for (int k = 0; k <= setup.count; k++)
+            steps[k] = setup.b[k] * step_x;
+    }
+
+    void seek(int next_column)
+    {
+        if (next_column == column + 1)
+            for (int k = 0; k <= setup.count; k++)
+                values[k] += steps[k];
+        else
+        {
+            double x = first_x + next_column * step_x;
+            for (int k = 0; k <= setup.count; k++)
+                values[k] = setup.a[k] + setup.b[k] * x + setup.c[k] * y;
+        }
+        column = next_column;
+    }
+
+    // Color of the current sample from attributes 0..2
+    void color(unsigned char &red, unsigned char &green, unsigned char &blue) const
+    {
+        double w = 1 / values[0];
+        auto channel = [&](int k) { return (unsigned char)max(0L, min(255L, lround(values[k + 1] * w))); };
+        red = channel(0), green = channel(1), blue = channel(2);
+    }
+};
+
+// Persistent depth and color buffers that triangles are drawn into, possibly clipped to a pixel rectangle
+class Rasterizer
+{
+public:
+    virtual ~Rasterizer() {}
+
+    // Resets depth and color inside the rectangle
+    virtual void clear(const PixelRect &rect) = 0;
+
+    // Draws the triangles (all, or the listed indices in order), returns the number of fragments depth tested
+    virtual size_t draw(const vector<Triangle> &triangles, const PixelRect &rect) = 0;
+    virtual size_t draw(const vector<Triangle> &triangles, const vector<size_t> &indices, const PixelRect &rect) = 0;
+
+    // Pixels a triangle would depth test if drawn unclipped, empty when culled or off screen.
+    // z_nearest is lowered to a bound on the depth of every fragment tested.
+    virtual PixelRect footprint(const Triangle &triangle, double *z_nearest = nullptr) = 0;
+
+    // Whether a fragment at depth z_nearest or farther could still pass the depth test somewhere in the rectangle
+    virtual bool occlusion_query(const PixelRect &rect, double z_nearest) = 0;
+
+    // Produces the per-pixel z-buffer and image, release hands over the buffers when the rasterizer is done
+    virtual void resolve(vector<vector<double>> &z_buffer, bitmap_image &image, bool release = false) = 0;
+};
+
+// Scan converts triangles on a sample grid of sqrt(Samples) x sqrt(Samples) per pixel.
+// Precision, depth format, culling and sample count are template parameters and cost the per-sample
+// loops nothing. The other features are runtime members: whether a triangle is translucent (A-buffer),
+// shaded or large is decided once per triangle, the span buffer once per span and the fill routine once
+// per span from depth_planes. Loops that read stored depths through stored_depth (translucent fills,
+// compositing, span row checks, occlusion queries and resolve) still test depth_planes per sample.
+template <typename Scalar, typename DepthFormat, CullMode Cull, int Samples>
+class SpecializedRasterizer : public Rasterizer
+{
+    static_assert(Samples == 1 || Samples == 4, "Supported sample counts are 1 and 4");
+    typedef typename DepthFormat::Storage DepthStorage;
+    static constexpr int grid = Samples == 4 ? 2 : 1;
+
+    RasterConfig config;
+    DepthFormat depth_format;
+
+    int screen_width, screen_height;
+    Scalar z_min;
+    Scalar pixel_width, pixel_height;
+    Scalar topmost_center_y, bottommost_center_y, leftmost_center_x, rightmost_center_x;
+
+    DepthStorage cleared_depth;
+    vector<vector<DepthStorage>> depth_buffer;
+    bitmap_image sample_image;
+
+    // Depth z = a + b * x + c * y over the samples of one triangle
+    struct DepthPlane
+    {
+        double a, b, c;
+    };
+
+    // Compressed depth storage (depth_compression K): a tile stores up to K planes and a selector per
+    // sample, 0 for cleared and k for plane k. A depth is only stored as a selector when the plane
+    // reproduces it bit for bit, otherwise the tile expands to one depth per sample, so the
+    // compression is lossless.
+    static constexpr int DEPTH_TILE = 8;
+    struct DepthTile
+    {
+        int plane_count = 0;
+        DepthPlane planes[MAX_DEPTH_PLANES];
+        uint8_t selector[DEPTH_TILE * DEPTH_TILE] = {};
+        vector<DepthStorage> samples;
+    };
+
+    int depth_planes, tiles_x;
+    vector<DepthTile> depth_tiles;
+
+    // Span buffer visibility (visibility spans): spans are collected per row in draw order and
+    // resolved into visible segments, so every sample is written once
+    struct Span
+    {
+        int left, right;
+        Scalar x_a, x_b, z_a, z_b, slope_error;
+        const Triangle *triangle;
+        DepthPlane plane;
+        // Index into span_setups, -1 without vertex attributes
+        int shading;
+    };
+
+    // Samples [left, right] of a row show span owner, -1 for the cleared background
+    struct SpanSegment
+    {
+        int left, right, owner;
+    };
+
+    bool span_buffer;
+    vector<vector<Span>> span_rows;
+    // Attribute setups of the shaded triangles with spans waiting in span_rows
+    vector<AttributeSetup> span_setups;
+
+    // A-buffer (abuffer N): samples of translucent triangles that pass the opaque depth test are kept in
+    // per-sample lists allocated from a pool of N fragments, then sorted and blended over the opaque color
+    // at resolve time. Fragments behind the final opaque depth are discarded then.
+    struct Fragment
+    {
+        DepthStorage depth;
+        unsigned char red, green, blue;
+        float alpha;
+        int next;
+    };
+
+    int abuffer_fragments;
+    vector<Fragment> fragment_pool;
+    vector<int> fragment_heads;
+    int free_fragment = -1;
+    size_t fragments_in_use = 0;
+
+    struct ScreenPoint
+    {
+        Scalar x, y, z;
+    };
+
+    static ScreenPoint toPoint(const Matrix &m)
+    {
+        return ScreenPoint{Scalar(m.elements[0][0]), Scalar(m.elements[1][0]), Scalar(m.elements[2][0])};
+    }
+
+    template <typename T>
+    static bool same_bits(const T &a, const T &b) { return memcmp(&a, &b, sizeof(T)) == 0; }
+
+    static DepthPlane triangle_plane(const ScreenPoint &A, const ScreenPoint &B, const ScreenPoint &C)
+    {
+        double ux = B.x - A.x, uy = B.y - A.y, uz = B.z - A.z;
+        double vx = C.x - A.x, vy = C.y - A.y, vz = C.z - A.z;
+        double nx = uy * vz - uz * vy, ny = uz * vx - ux * vz, nz = ux * vy - uy * vx;
+        double b = -nx / nz, c = -ny / nz;
+        return DepthPlane{A.z - b * A.x - c * A.y, b, c};
+    }
+
+    double plane_depth(const DepthPlane &plane, int row, int column) const
+    {
+        Scalar pixel_x = leftmost_center_x + column * pixel_width;
+        Scalar pixel_y = bottommost_center_y + (screen_height - 1 - row) * pixel_height;
+        return plane.a + plane.b * pixel_x + plane.c * pixel_y;
+    }
+
+    DepthTile &depth_tile(int row, int column) { return depth_tiles[row / DEPTH_TILE * tiles_x + column / DEPTH_TILE]; }
+
+    DepthStorage tile_depth(const DepthTile &tile, int row, int column) const
+    {
+        int index = row % DEPTH_TILE * DEPTH_TILE + column % DEPTH_TILE;
+        if (!tile.samples.empty())
+            return tile.samples[index];
+        int selected = tile.selector[index];
+        return selected ? depth_format.encode(plane_depth(tile.planes[selected - 1], row, column)) : cleared_depth;
+    }
+
+    DepthStorage stored_depth(int row, int column)
+    {
+        return depth_planes ? tile_depth(depth_tile(row, column), row, column) : depth_buffer[row][column];
+    }
+
+    // Slot of plane in a compressed tile, planes no sample selects any more are dropped when it is full
+    int tile_plane_slot(DepthTile &tile, const DepthPlane &plane)
+    {
+        for (int k = 0; k < tile.plane_count; k++)
+            if (same_bits(tile.planes[k], plane))
+                return k;
+
+        if (tile.plane_count == depth_planes)
+        {
+            bool used[MAX_DEPTH_PLANES] = {};
+            for (uint8_t selected : tile.selector)
+                if (selected)
+                    used[selected - 1] = true;
+
+            uint8_t remap[MAX_DEPTH_PLANES + 1] = {};
+            int kept = 0;
+            for (int k = 0; k < tile.plane_count; k++)
+                if (used[k])
+                {
+                    tile.planes[kept] = tile.planes[k];
+                    remap[k + 1] = ++kept;
+                }
+            for (uint8_t &selected : tile.selector)
+                selected = remap[selected];
+            tile.plane_count = kept;
+        }
+
+        if (tile.plane_count == depth_planes)
+            return -1;
+        STATS_ADD(depth_bytes, sizeof(DepthPlane));
+        tile.planes[tile.plane_count] = plane;
+        return tile.plane_count++;
+    }
+
+    // Expands a compressed tile containing (row, column) to one depth per sample
+    void decompress_tile(DepthTile &tile, int row, int column)
+    {
+        int top = row - row % DEPTH_TILE, left = column - column % DEPTH_TILE;
+        vector<DepthStorage> samples(DEPTH_TILE * DEPTH_TILE);
+        for (int y = 0; y < DEPTH_TILE; y++)
+            for (int x = 0; x < DEPTH_TILE; x++)
+                samples[y * DEPTH_TILE + x] = tile_depth(tile, top + y, left + x);
+        tile.samples.swap(samples);
+        tile.plane_count = 0;
+        STATS_ADD(depth_bytes, DEPTH_TILE * DEPTH_TILE * sizeof(DepthStorage));
+    }
+
+    void store_tile_depth(DepthTile &tile, int row, int column, DepthStorage stored_z, const DepthPlane &plane)
+    {
+        int index = row % DEPTH_TILE * DEPTH_TILE + column % DEPTH_TILE;
+        if (tile.samples.empty())
+        {
+            int slot = tile_plane_slot(tile, plane);
+            if (slot >= 0 && same_bits(depth_format.encode(plane_depth(plane, row, column)), stored_z))
+            {
+                STATS_ADD(depth_bytes, 1);
+                tile.selector[index] = slot + 1;
+                return;
+            }
+            decompress_tile(tile, row, column);
+        }
+        STATS_ADD(depth_bytes, sizeof(DepthStorage));
+        tile.samples[index] = stored_z;
+    }
+
+    void fill_span_compressed(int row, int left_column, int right_column, Scalar x_a, Scalar x_b, Scalar z_a, Scalar z_b,
+                              const Triangle &triangle, const DepthPlane &plane, const AttributeSetup *shading = nullptr)
+    {
+        optional<AttributeSpan> attributes;
+        if (shading)
+            attributes.emplace(attribute_span(*shading, row));
+        for (int start = left_column; start <= right_column;)
+        {
+            int end = min(right_column, start - start % DEPTH_TILE + DEPTH_TILE - 1);
+            DepthTile &tile = depth_tile(row, start);
+            STATS_ADD(depth_bytes, 1 + tile.plane_count * sizeof(DepthPlane));
+            for (int j = start; j <= end; j++)
+            {
+                Scalar pixel_z = span_depth(j, x_a, x_b, z_a, z_b);
+                DepthStorage stored_z = depth_format.encode(pixel_z);
+                STATS_ADD(depth_bytes, tile.samples.empty() ? 1 : sizeof(DepthStorage));
+
+                // z-value range and improvement check
+                if (pixel_z >= z_min && stored_z < tile_depth(tile, row, j))
+                {
+                    STATS_ADD(fragments_passed, 1);
+                    STATS_ADD(depth_bytes_uncompressed, sizeof(DepthStorage));
+                    store_tile_depth(tile, row, j, stored_z, plane);
+                    set_sample_color(row, j, triangle, attributes ? &*attributes : nullptr);
+                }
+            }
+            start = end + 1;
+        }
+    }
+
+    // Takes a fragment from the pool, or applies the overflow policy when it is exhausted
+    void insert_fragment(int row, int column, const Fragment &fragment)
+    {
+        int &head = fragment_heads[row * screen_width + column];
+        if (free_fragment < 0)
+        {
+            STATS_ADD(abuffer_overflows, 1);
+            if (!config.abuffer_merge || head < 0)
+                return;
+
+            // The incoming fragment and the stored one nearest in depth are blended as adjacent layers
+            Fragment *closest = nullptr;
+            double distance = numeric_limits<double>::infinity();
+            for (int k = head; k >= 0; k = fragment_pool[k].next)
+            {
+                double d = fabs(depth_format.decode(fragment_pool[k].depth) - depth_format.decode(fragment.depth));
+                if (d < distance)
+                    distance = d, closest = &fragment_pool[k];
+            }
+            Fragment front = fragment, back = *closest;
+            if (back.depth < front.depth)
+                swap(front, back);
+            float alpha = front.alpha + back.alpha * (1 - front.alpha);
+            auto blend = [&](unsigned char a, unsigned char b)
+            { return (unsigned char)lround((a * front.alpha + b * back.alpha * (1 - front.alpha)) / alpha); };
+            closest->red = blend(front.red, back.red);
+            closest->green = blend(front.green, back.green);
+            closest->blue = blend(front.blue, back.blue);
+            closest->alpha = alpha;
+            closest->depth = front.depth;
+            STATS_ADD(abuffer_merged, 1);
+            return;
+        }
+
+        int index = free_fragment;
+        free_fragment = fragment_pool[index].next;
+        fragment_pool[index] = fragment;
+        fragment_pool[index].next = head;
+        head = index;
+        STATS_ADD(abuffer_stored, 1);
+        fragments_in_use++;
+        STATS_MAX(abuffer_peak, fragments_in_use);
+    }
+
+    void fill_span_translucent(int row, int left_column, int right_column, Scalar x_a, Scalar x_b, Scalar z_a, Scalar z_b,
+                               const Triangle &triangle, const AttributeSetup *shading = nullptr)
+    {
+        Fragment fragment{DepthStorage(), triangle.red, triangle.green, triangle.blue, float(triangle.alpha), -1};
+        optional<AttributeSpan> attributes;
+        if (shading)
+            attributes.emplace(attribute_span(*shading, row));
+        for (int j = left_column; j <= right_column; j++)
+        {
+            Scalar pixel_z = span_depth(j, x_a, x_b, z_a, z_b);
+            fragment.depth = depth_format.encode(pixel_z);
+
+            // Opaque depth so far only ever moves nearer, so a fragment behind it is hidden for good
+            if (pixel_z >= z_min && fragment.depth < stored_depth(row, j))
+            {
+                STATS_ADD(fragments_passed, 1);
+                if (attributes)
+                {
+                    attributes->seek(j);
+                    attributes->color(fragment.red, fragment.green, fragment.blue);
+                }
+                insert_fragment(row, j, fragment);
+            }
+        }
+    }
+
+    // Blends every sample's fragments in front of its opaque depth over its opaque color, farthest first and
+    // in draw order at equal depth. nearest receives the depth of each sample's nearest blended fragment.
+    void composite_fragments(bitmap_image &composited, vector<DepthStorage> &nearest)
+    {
+        composited = sample_image;
+        nearest.assign(fragment_heads.size(), cleared_depth);
+        vector<const Fragment *> layers;
+        for (int row = 0; row < screen_height; row++)
+            for (int column = 0; column < screen_width; column++)
+            {
+                int sample = row * screen_width + column;
+                DepthStorage opaque = stored_depth(row, column);
+                layers.clear();
+                for (int k = fragment_heads[sample]; k >= 0; k = fragment_pool[k].next)
+                    if (fragment_pool[k].depth < opaque)
+                        layers.push_back(&fragment_pool[k]);
+                if (layers.empty())
+                    continue;
+
+                // Lists hold the latest fragment first
+                reverse(layers.begin(), layers.end());
+                stable_sort(layers.begin(), layers.end(), [](const Fragment *a, const Fragment *b) { return a->depth > b->depth; });
+
+                unsigned char r, g, b;
+                composited.get_pixel(column, row, r, g, b);
+                double red = r, green = g, blue = b;
+                for (const Fragment *layer : layers)
+                {
+                    red = layer->alpha * layer->red + (1 - layer->alpha) * red;
+                    green = layer->alpha * layer->green + (1 - layer->alpha) * green;
+                    blue = layer->alpha * layer->blue + (1 - layer->alpha) * blue;
+                }
+                composited.set_pixel(column, row, lround(red), lround(green), lround(blue));
+                nearest[sample] = layers.back()->depth;
+            }
+    }
+
+    // Triangles at least this many samples wide take the block path, smaller ones test every sample
+    static constexpr int LARGE_TRIANGLE_SAMPLES = 32;
+    static constexpr int DEPTH_BLOCK = 8;
+
+    Scalar span_depth(int column, Scalar x_a, Scalar x_b, Scalar z_a, Scalar z_b) const
+    {
+        // x-cordinate and z-value of current pixel
+        Scalar pixel_x = leftmost_center_x + column * pixel_width;
+        return z_b - (z_b - z_a) * (x_b - pixel_x) / (x_b - x_a);
+    }
+
+    void fill_span(int row, int left_column, int right_column, Scalar x_a, Scalar x_b, Scalar z_a, Scalar z_b, const Triangle &triangle)
+    {
+        vector<DepthStorage> &depth_row = depth_buffer[row];
+        for (int j = left_column; j <= right_column; j++)
+        {
+            Scalar pixel_z = span_depth(j, x_a, x_b, z_a, z_b);
+            DepthStorage stored_z = depth_format.encode(pixel_z);
+
+            // z-value range and improvement check
+            if (pixel_z >= z_min && stored_z < depth_row[j])
+            {
+                STATS_ADD(fragments_passed, 1);
+                STATS_ADD(depth_bytes, sizeof(DepthStorage));
+                STATS_ADD(depth_bytes_uncompressed, sizeof(DepthStorage));
+                depth_row[j] = stored_z;
+                sample_image.set_pixel(j, row, triangle.red, triangle.green, triangle.blue);
+            }
+        }
+    }
+
+    Scalar span_slope_error(Scalar x_a, Scalar x_b, Scalar z_a, Scalar z_b) const
+    {
+        return abs((z_b - z_a) / (x_b - x_a)) * (abs(x_a) + abs(x_b) + abs(leftmost_center_x) + abs(rightmost_center_x));
+    }
+
+    // Bounds of span_depth over columns [first, last], widened by its rounding error
+    pair<Scalar, Scalar> span_depth_bounds(int first, int last, Scalar x_a, Scalar x_b, Scalar z_a, Scalar z_b, Scalar slope_error) const
+    {
+        Scalar z_first = span_depth(first, x_a, x_b, z_a, z_b), z_last = span_depth(last, x_a, x_b, z_a, z_b);
+        Scalar margin = 64 * numeric_limits<Scalar>::epsilon() * (1 + abs(z_a) + abs(z_b) + abs(z_first) + abs(z_last) + slope_error);
+        return make_pair(min(z_first, z_last) - margin, max(z_first, z_last) + margin);
+    }
+
+    // Attribute stepper along a row of samples, starting at the leftmost sample center
+    AttributeSpan attribute_span(const AttributeSetup &shading, int row) const
+    {
+        return AttributeSpan(shading, bottommost_center_y + (screen_height - 1 - row) * pixel_height, leftmost_center_x, pixel_width);
+    }
+
+    // Writes the flat color, or the interpolated one when the triangle has vertex attributes
+    void set_sample_color(int row, int column, const Triangle &triangle, AttributeSpan *attributes)
+    {
+        if (!attributes)
+        {
+            sample_image.set_pixel(column, row, triangle.red, triangle.green, triangle.blue);
+            return;
+        }
+        unsigned char red, green, blue;
+        attributes->seek(column);
+        attributes->color(red, green, blue);
+        sample_image.set_pixel(column, row, red, green, blue);
+    }
+
+    // fill_span for triangles with vertex attributes, the attributes step along with the columns
+    void fill_span_shaded(int row, int left_column, int right_column, Scalar x_a, Scalar x_b, Scalar z_a, Scalar z_b,
+                          const AttributeSetup &shading)
+    {
+        vector<DepthStorage> &depth_row = depth_buffer[row];
+        AttributeSpan attributes = attribute_span(shading, row);
+        for (int j = left_column; j <= right_column; j++)
+        {
+            Scalar pixel_z = span_depth(j, x_a, x_b, z_a, z_b);
+            DepthStorage stored_z = depth_format.encode(pixel_z);
+            attributes.seek(j);
+
+            // z-value range and improvement check
+            if (pixel_z >= z_min && stored_z < depth_row[j])
+            {
+                STATS_ADD(fragments_passed, 1);
+                STATS_ADD(depth_bytes, sizeof(DepthStorage));
+                STATS_ADD(depth_bytes_uncompressed, sizeof(DepthStorage));
+                depth_row[j] = stored_z;
+                unsigned char red, green, blue;
+                attributes.color(red, green, blue);
+                sample_image.set_pixel(j, row, red, green, blue);
+            }
+        }
+    }
+
+    // Depth tests a span in aligned blocks of samples. The depth along a span is linear, so the
+    // values at the block ends, widened by the rounding error of span_depth, bound every sample of
+    // the block: a block entirely behind the stored depths is skipped and one entirely in front is
+    // written without comparisons. Blocks straddling the stored depths are tested per sample.
+    void fill_span_blocks(int row, int left_column, int right_column, Scalar x_a, Scalar x_b, Scalar z_a, Scalar z_b, const Triangle &triangle)
+    {
+        vector<DepthStorage> &depth_row = depth_buffer[row];
+        const Scalar slope_error = span_slope_error(x_a, x_b, z_a, z_b);
+
+        for (int start = left_column; start <= right_column;)
         {
-            return Vector(m.elements[0][0], m.elements[1][0], m.elements[2][0]);
-        };
-        Vector A = toVector(triangle.vertices[0]);
-        Vector B = toVector(triangle.vertices[1]);
-        Vector C = toVector(triangle.vertices[2]);
+            int end = min(right_column, start - start % DEPTH_BLOCK + DEPTH_BLOCK - 1);
+            if (end - start + 1 == DEPTH_BLOCK)
+            {
+                auto [z_low, z_high] = span_depth_bounds(start, end, x_a, x_b, z_a, z_b, slope_error);
+
+                DepthStorage block_min = depth_row[start], block_max = depth_row[start];
+                for (int j = start + 1; j <= end; j++)
+                {
+                    block_min = min(block_min, depth_row[j]);
+                    block_max = max(block_max, depth_row[j]);
+                }
 
-        // Projection of triangle edges on xy plane ( z = 0 )
-        Line projection_of_AB = Line(Point(A.x, A.y, 0), Point(B.x, B.y, 0));
-        Line projection_of_AC = Line(Point(A.x, A.y, 0), Point(C.x, C.y, 0));
-        Line projection_of_BC = Line(Point(B.x, B.y, 0), Point(C.x, C.y, 0));
+                // Trivial reject, every sample fails the improvement check
+                if (depth_format.encode(z_low) >= block_max)
+                {
+                    start = end + 1;
+                    continue;
+                }
 
-        double bottom_scanline = max(C.y, bottommost_center_y);
-        double top_scanline = min(A.y, topmost_center_y);
+                // Trivial accept, every sample passes both checks
+                if (z_low >= z_min && depth_format.encode(z_high) < block_min)
+                {
+                    STATS_ADD(fragments_passed, DEPTH_BLOCK);
+                    STATS_ADD(depth_bytes, DEPTH_BLOCK * sizeof(DepthStorage));
+                    STATS_ADD(depth_bytes_uncompressed, DEPTH_BLOCK * sizeof(DepthStorage));
+                    for (int j = start; j <= end; j++)
+                    {
+                        depth_row[j] = depth_format.encode(span_depth(j, x_a, x_b, z_a, z_b));
+                        sample_image.set_pixel(j, row, triangle.red, triangle.green, triangle.blue);
+                    }
+                    start = end + 1;
+                    continue;
+                }
+            }
+
+            fill_span(row, start, end, x_a, x_b, z_a, z_b, triangle);
+            start = end + 1;
+        }
+    }
+
+    void write_depth(int row, int column, DepthStorage stored_z, const DepthPlane &plane)
+    {
+        if (depth_planes)
+            store_tile_depth(depth_tile(row, column), row, column, stored_z, plane);
+        else
+        {
+            STATS_ADD(depth_bytes, sizeof(DepthStorage));
+            depth_buffer[row][column] = stored_z;
+        }
+    }
+
+    static void append_segment(vector<SpanSegment> &segments, int left, int right, int owner)
+    {
+        if (!segments.empty() && segments.back().owner == owner && segments.back().right + 1 == left)
+            segments.back().right = right;
+        else
+            segments.push_back(SpanSegment{left, right, owner});
+    }
+
+    // Decides which of span and the current owner is visible on samples [first, last]. Depth bounds
+    // settle whole ranges, ranges where the bounds overlap are halved down to single samples, which
+    // get the exact z-buffer test, so the result matches drawing the spans in order.
+    void resolve_overlap(vector<SpanSegment> &pieces, const vector<Span> &spans, int span, int owner, int first, int last)
+    {
+        const Span &incoming = spans[span];
+        auto [z_low, z_high] = span_depth_bounds(first, last, incoming.x_a, incoming.x_b, incoming.z_a, incoming.z_b, incoming.slope_error);
+
+        DepthStorage owner_low = cleared_depth, owner_high = cleared_depth;
+        if (owner >= 0)
+        {
+            const Span &visible = spans[owner];
+            auto bounds = span_depth_bounds(first, last, visible.x_a, visible.x_b, visible.z_a, visible.z_b, visible.slope_error);
+            owner_low = depth_format.encode(bounds.first), owner_high = depth_format.encode(bounds.second);
+        }
+
+        if (z_low >= z_min && depth_format.encode(z_high) < owner_low)
+            append_segment(pieces, first, last, span);
+        else if (z_high < z_min || depth_format.encode(z_low) >= owner_high)
+            append_segment(pieces, first, last, owner);
+        else if (first == last)
+        {
+            STATS_ADD(span_samples_compared, 1);
+            Scalar pixel_z = span_depth(first, incoming.x_a, incoming.x_b, incoming.z_a, incoming.z_b);
+            DepthStorage owner_z = cleared_depth;
+            if (owner >= 0)
+                owner_z = depth_format.encode(span_depth(first, spans[owner].x_a, spans[owner].x_b, spans[owner].z_a, spans[owner].z_b));
+            append_segment(pieces, first, last, pixel_z >= z_min && depth_format.encode(pixel_z) < owner_z ? span : owner);
+        }
+        else
+        {
+            int middle = first + (last - first) / 2;
+            resolve_overlap(pieces, spans, span, owner, first, middle);
+            resolve_overlap(pieces, spans, span, owner, middle + 1, last);
+        }
+    }
+
+    // Clips span against the visible segments it overlaps and splices the result in
+    void insert_span(vector<SpanSegment> &segments, const vector<Span> &spans, int span)
+    {
+        const Span &incoming = spans[span];
+        auto first = upper_bound(segments.begin(), segments.end(), incoming.left,
+                                 [](int column, const SpanSegment &segment) { return column < segment.left; }) - 1;
+        auto last = first;
+
+        vector<SpanSegment> pieces;
+        for (; last != segments.end() && last->left <= incoming.right; ++last)
+        {
+            SpanSegment segment = *last;
+            if (segment.left < incoming.left)
+                append_segment(pieces, segment.left, incoming.left - 1, segment.owner);
+            resolve_overlap(pieces, spans, span, segment.owner, max(segment.left, incoming.left), min(segment.right, incoming.right));
+            if (segment.right > incoming.right)
+                append_segment(pieces, incoming.right + 1, segment.right, segment.owner);
+        }
+
+        auto position = segments.erase(first, last);
+        segments.insert(position, pieces.begin(), pieces.end());
+    }
+
+    void resolve_span_row(int row, const vector<Span> &spans, const PixelRect &clip)
+    {
+        // Spans are resolved against the cleared background, rows already holding depths take the z-buffer path
+        for (int j = clip.left; j <= clip.right; j++)
+        {
+            STATS_ADD(depth_bytes, depth_planes ? 1 : sizeof(DepthStorage));
+            if (!same_bits(stored_depth(row, j), cleared_depth))
+            {
+                for (const Span &span : spans)
+                {
+                    const AttributeSetup *shading = span.shading >= 0 ? &span_setups[span.shading] : nullptr;
+                    if (depth_planes)
+                        fill_span_compressed(row, span.left, span.right, span.x_a, span.x_b, span.z_a, span.z_b, *span.triangle,
+                                             span.plane, shading);
+                    else
+                    {
+                        STATS_ADD(depth_bytes, (span.right - span.left + 1) * sizeof(DepthStorage));
+                        if (shading)
+                            fill_span_shaded(row, span.left, span.right, span.x_a, span.x_b, span.z_a, span.z_b, *shading);
+                        else
+                            fill_span(row, span.left, span.right, span.x_a, span.x_b, span.z_a, span.z_b, *span.triangle);
+                    }
+                }
+                return;
+            }
+        }
+
+        vector<SpanSegment> segments = {SpanSegment{clip.left, clip.right, -1}};
+        for (int span = 0; span < (int)spans.size(); span++)
+            insert_span(segments, spans, span);
+
+        for (const SpanSegment &segment : segments)
+        {
+            if (segment.owner < 0)
+                continue;
+            const Span &visible = spans[segment.owner];
+            optional<AttributeSpan> attributes;
+            if (visible.shading >= 0)
+                attributes.emplace(attribute_span(span_setups[visible.shading], row));
+            for (int j = segment.left; j <= segment.right; j++)
+            {
+                STATS_ADD(fragments_passed, 1);
+                STATS_ADD(depth_bytes_uncompressed, sizeof(DepthStorage));
+                write_depth(row, j, depth_format.encode(span_depth(j, visible.x_a, visible.x_b, visible.z_a, visible.z_b)), visible.plane);
+                set_sample_color(row, j, *visible.triangle, attributes ? &*attributes : nullptr);
+            }
+        }
+    }
+
+    void resolve_spans(const PixelRect &clip)
+    {
+        STATS_TIME(depth_test);
+        for (int row = clip.top; row <= clip.bottom; row++)
+        {
+            STATS_ADD(spans, span_rows[row].size());
+            if (!span_rows[row].empty())
+                resolve_span_row(row, span_rows[row], clip);
+            span_rows[row].clear();
+        }
+        span_setups.clear();
+    }
+
+    // Scan converts one triangle inside the clip rectangle (in samples). Without Fill only the
+    // rectangle of samples that would be tested is accumulated into touched, and their nearest depth into z_nearest.
+    template <bool Fill>
+    size_t scan_triangle(const Triangle &triangle, const PixelRect &clip, PixelRect *touched = nullptr, double *z_nearest = nullptr)
+    {
+        size_t fragments = 0;
+
+        // Counter-clockwise triangles face the viewer
+        if (Cull != CullMode::NONE)
+        {
+            ScreenPoint P = toPoint(triangle.vertices[0]), Q = toPoint(triangle.vertices[1]), R = toPoint(triangle.vertices[2]);
+            Scalar signed_area = (Q.x - P.x) * (R.y - P.y) - (R.x - P.x) * (Q.y - P.y);
+            if ((Cull == CullMode::BACK && signed_area < 0) || (Cull == CullMode::FRONT && signed_area > 0))
+            {
+                STATS_ADD(triangles_culled, Fill);
+                return 0;
+            }
+        }
+
+        // Vertices ordered by y-cordinates like Triangle::reorder_vertices, without copying the triangle
+        const Matrix *ordered[3] = {&triangle.vertices[0], &triangle.vertices[1], &triangle.vertices[2]};
+        for (int k = 1; k < 3; k++)
+            for (int m = k; m > 0 && ordered[m]->elements[1][0] > ordered[m - 1]->elements[1][0]; m--)
+                swap(ordered[m], ordered[m - 1]);
+
+        // Trianle vertices -> A, B, C
+        ScreenPoint A = toPoint(*ordered[0]);
+        ScreenPoint B = toPoint(*ordered[1]);
+        ScreenPoint C = toPoint(*ordered[2]);
+
+        // Wide triangles fill their spans block by block
+        bool large = max({A.x, B.x, C.x}) - min({A.x, B.x, C.x}) >= LARGE_TRIANGLE_SAMPLES * pixel_width;
+        bool translucent = Fill && abuffer_fragments && triangle.alpha < 1;
+        optional<AttributeSetup> setup;
+        if (Fill && !triangle.attributes.empty())
+            setup.emplace(triangle);
+        const AttributeSetup *shading = setup ? &*setup : nullptr;
+        // Spans hold the setup by index, it is copied into span_setups once
+        int span_shading = -1;
+        DepthPlane plane{};
+        if (Fill && depth_planes)
+            plane = triangle_plane(A, B, C);
+
+        Scalar bottom_scanline = max(C.y, bottommost_center_y);
+        Scalar top_scanline = min(A.y, topmost_center_y);
 
         int top_row = round((top_scanline - bottommost_center_y) / pixel_height);
         int bottom_row = round((bottom_scanline - bottommost_center_y) / pixel_height);
 
+        // Rows above the clip rectangle are still set up, the vertex relabeling below depends on them
+        bottom_row = max(bottom_row, screen_height - 1 - clip.bottom);
+
+        STATS_ADD(scanlines, Fill ? max(0, top_row - bottom_row + 1) : 0);
         for (int i = top_row; i >= bottom_row; i--)
         {
-            double current_y = bottommost_center_y + i * pixel_height;
-
-            Line current_line = Line(Point(0, current_y, 0), Point(1, current_y, 0));
+            Scalar current_y = bottommost_center_y + i * pixel_height;
 
-            pair<bool, Point> AB_line_intersection = check_line_segment_intersection(current_line, projection_of_AB);
-            pair<bool, Point> AC_line_intersection = check_line_segment_intersection(current_line, projection_of_AC);
-            pair<bool, Point> BC_line_intersection = check_line_segment_intersection(current_line, projection_of_BC);
+            // Crossings of the scanline with the projection of triangle edges on xy plane ( z = 0 )
+            pair<bool, Scalar> AB_line_intersection = scanline_crossing(A.x, A.y, B.x, B.y, current_y);
+            pair<bool, Scalar> AC_line_intersection = scanline_crossing(A.x, A.y, C.x, C.y, current_y);
+            pair<bool, Scalar> BC_line_intersection = scanline_crossing(B.x, B.y, C.x, C.y, current_y);
 
             int intersection_count = AB_line_intersection.first + AC_line_intersection.first + BC_line_intersection.first;
 
-            auto reorder_points_and_lines = [&](string order)
+            if (intersection_count == 0)
+                continue;
+
+            // Relabel the vertices so that AB and AC are the crossed edges, the relabeling carries over to later scanlines
+            if (intersection_count == 2 && !(AB_line_intersection.first && AC_line_intersection.first))
             {
-                if (order[1] > order[2])
-                    swap(order[1], order[2]);
-                if (order == "ABC")
-                {
-                    // No change
-                }
-                else if (order == "BAC")
+                if (AB_line_intersection.first)
                 {
                     tie(A, B, C) = make_tuple(B, A, C);
-                    tie(projection_of_AB, projection_of_AC, projection_of_BC) = make_tuple(projection_of_AB, projection_of_BC, projection_of_AC);
                     tie(AB_line_intersection, AC_line_intersection, BC_line_intersection) = make_tuple(AB_line_intersection, BC_line_intersection, AC_line_intersection);
                 }
-                else if (order == "CAB")
+                else
                 {
                     tie(A, B, C) = make_tuple(C, A, B);
-                    tie(projection_of_AB, projection_of_AC, projection_of_BC) = make_tuple(projection_of_AC, projection_of_BC, projection_of_AB);
                     tie(AB_line_intersection, AC_line_intersection, BC_line_intersection) = make_tuple(AC_line_intersection, BC_line_intersection, AB_line_intersection);
                 }
-            };
+            }
 
-            if (intersection_count == 0)
+            int row = screen_height - 1 - i;
+            if (row < clip.top)
                 continue;
-            if (intersection_count == 2)
-                reorder_points_and_lines(AB_line_intersection.first ? (AC_line_intersection.first ? "ABC" : "BAC") : "CAB");
 
             // Intersection x-cordination
-            double x_a = AB_line_intersection.second.x;
-            double x_b = AC_line_intersection.second.x;
+            Scalar x_a = AB_line_intersection.second;
+            Scalar x_b = AC_line_intersection.second;
 
             // Interpolation of z-values
-            double z_a = A.z - (A.z - B.z) * (A.y - current_y) / (A.y - B.y);
-            double z_b = A.z - (A.z - C.z) * (A.y - current_y) / (A.y - C.y);
+            Scalar z_a = A.z - (A.z - B.z) * (A.y - current_y) / (A.y - B.y);
+            Scalar z_b = A.z - (A.z - C.z) * (A.y - current_y) / (A.y - C.y);
 
             // Proper ordering
             if (x_a > x_b)
@@ -154,33 +1053,530 @@ void rasterization(vector<Triangle> &triangles)
             // Column range
             int left_column = round((max(x_a, leftmost_center_x) - leftmost_center_x) / pixel_width);
             int right_column = round((min(x_b, rightmost_center_x) - leftmost_center_x) / pixel_width);
+            left_column = max(left_column, clip.left);
+            right_column = min(right_column, clip.right);
+
+            fragments += max(0, right_column - left_column + 1);
+
+            if constexpr (!Fill)
+            {
+                if (left_column <= right_column)
+                {
+                    *touched = touched->empty() ? PixelRect(left_column, row, right_column, row)
+                                                : PixelRect(min(touched->left, left_column), min(touched->top, row),
+                                                            max(touched->right, right_column), max(touched->bottom, row));
+                    if (z_nearest)
+                        *z_nearest = min(*z_nearest, (double)span_depth_bounds(left_column, right_column, x_a, x_b, z_a, z_b,
+                                                                               span_slope_error(x_a, x_b, z_a, z_b)).first);
+                }
+                continue;
+            }
+
+            if (translucent)
+            {
+                STATS_TIME(depth_test);
+                fill_span_translucent(row, left_column, right_column, x_a, x_b, z_a, z_b, triangle, shading);
+                continue;
+            }
+
+            if (span_buffer)
+            {
+                if (left_column <= right_column)
+                {
+                    if (shading && span_shading < 0)
+                    {
+                        span_shading = span_setups.size();
+                        span_setups.push_back(*shading);
+                    }
+                    span_rows[row].push_back(Span{left_column, right_column, x_a, x_b, z_a, z_b,
+                                                  span_slope_error(x_a, x_b, z_a, z_b), &triangle, plane, span_shading});
+                }
+                continue;
+            }
 
             // Scanline filling
-            for (int j = left_column; j <= right_column; j++)
+            STATS_TIME(depth_test);
+            if (depth_planes)
+                fill_span_compressed(row, left_column, right_column, x_a, x_b, z_a, z_b, triangle, plane, shading);
+            else if (shading)
+                fill_span_shaded(row, left_column, right_column, x_a, x_b, z_a, z_b, *shading);
+            else if (large)
+                fill_span_blocks(row, left_column, right_column, x_a, x_b, z_a, z_b, triangle);
+            else
+                fill_span(row, left_column, right_column, x_a, x_b, z_a, z_b, triangle);
+        }
+
+        STATS_ADD(triangles_culled, Fill && fragments == 0);
+        STATS_ADD(triangles_rasterized, Fill && fragments != 0);
+        return fragments;
+    }
+
+    PixelRect sample_rect(const PixelRect &rect) const
+    {
+        return PixelRect(rect.left * grid, rect.top * grid, rect.right * grid + grid - 1, rect.bottom * grid + grid - 1);
+    }
+
+public:
+    SpecializedRasterizer(const RasterConfig &config) : config(config), depth_format(config)
+    {
+        // Sub-task-1: Read & Extract Data
+        screen_width = config.screen_width * grid, screen_height = config.screen_height * grid;
+        Scalar left_limit = config.left_limit, right_limit = config.right_limit;
+        Scalar bottom_limit = config.bottom_limit, top_limit = config.top_limit;
+        z_min = config.z_min;
+
+        // Size of a sample in normalized coordinates
+        pixel_width = (right_limit - left_limit) / screen_width;
+        pixel_height = (top_limit - bottom_limit) / screen_height;
+
+        // Center coordinates of edge samples
+        topmost_center_y = top_limit - pixel_height / 2.0;
+        bottommost_center_y = bottom_limit + pixel_height / 2.0;
+        leftmost_center_x = left_limit + pixel_width / 2.0;
+        rightmost_center_x = right_limit - pixel_width / 2.0;
+
+        // Sub-task-2: Initialize Z-buffer and Frame buffer
+        cleared_depth = depth_format.encode(config.z_max);
+        depth_planes = config.depth_planes;
+        span_buffer = config.span_buffer;
+        if (span_buffer)
+            span_rows.resize(screen_height);
+        tiles_x = (screen_width + DEPTH_TILE - 1) / DEPTH_TILE;
+        if (depth_planes)
+            depth_tiles.resize(tiles_x * ((screen_height + DEPTH_TILE - 1) / DEPTH_TILE));
+        else
+            depth_buffer.assign(screen_height, vector<DepthStorage>(screen_width, cleared_depth));
+        sample_image.setwidth_height(screen_width, screen_height);
+        sample_image.set_all_channels(0, 0, 0);
+
+        // Every pool entry starts on the free list
+        abuffer_fragments = config.abuffer_fragments;
+        if (abuffer_fragments)
+        {
+            fragment_pool.resize(abuffer_fragments);
+            for (int k = 0; k < abuffer_fragments; k++)
+                fragment_pool[k].next = k + 1 < abuffer_fragments ? k + 1 : -1;
+            free_fragment = 0;
+            fragment_heads.assign(screen_width * screen_height, -1);
+        }
+    }
+
+    void clear(const PixelRect &rect) override
+    {
+        PixelRect samples = sample_rect(rect);
+        for (int row = samples.top; row <= samples.bottom; row++)
+        {
+            if (!depth_planes)
+                fill(depth_buffer[row].begin() + samples.left, depth_buffer[row].begin() + samples.right + 1, cleared_depth);
+            for (int column = samples.left; column <= samples.right; column++)
             {
-                // x-cordinate and z-value of current pixel
-                double pixel_x = leftmost_center_x + j * pixel_width;
-                double pixel_z = z_b - (z_b - z_a) * (x_b - pixel_x) / (x_b - x_a);
+                if (depth_planes)
+                {
+                    DepthTile &tile = depth_tile(row, column);
+                    int index = row % DEPTH_TILE * DEPTH_TILE + column % DEPTH_TILE;
+                    if (tile.samples.empty())
+                        tile.selector[index] = 0;
+                    else
+                        tile.samples[index] = cleared_depth;
+                }
+                sample_image.set_pixel(column, row, 0, 0, 0);
 
-                // z-value range and improvement check
-                if (pixel_z >= z_min && pixel_z < z_buffer[screen_height - 1 - i][j])
+                // Fragments of the sample go back to the pool
+                if (abuffer_fragments)
                 {
-                    z_buffer[screen_height - 1 - i][j] = pixel_z;
-                    image.set_pixel(j, screen_height - 1 - i, triangle.red, triangle.green, triangle.blue);
+                    int &head = fragment_heads[row * screen_width + column];
+                    while (head >= 0)
+                    {
+                        int next = fragment_pool[head].next;
+                        fragment_pool[head].next = free_fragment;
+                        free_fragment = head;
+                        head = next;
+                        fragments_in_use--;
+                    }
                 }
             }
         }
+
+        // Expanded tiles that are cleared entirely become compressed again
+        if (depth_planes)
+            for (int row = samples.top - samples.top % DEPTH_TILE; row <= samples.bottom; row += DEPTH_TILE)
+                for (int column = samples.left - samples.left % DEPTH_TILE; column <= samples.right; column += DEPTH_TILE)
+                {
+                    DepthTile &tile = depth_tile(row, column);
+                    if (!tile.samples.empty() && all_of(tile.samples.begin(), tile.samples.end(),
+                                                        [&](DepthStorage depth) { return same_bits(depth, cleared_depth); }))
+                        tile = DepthTile();
+                }
     }
 
+    size_t draw(const vector<Triangle> &triangles, const PixelRect &rect) override
+    {
+        size_t fragments = 0;
+        PixelRect clip = sample_rect(rect);
+        STATS_ADD(triangles_in, triangles.size());
+        for (const Triangle &triangle : triangles)
+            fragments += scan_triangle<true>(triangle, clip);
+        STATS_ADD(fragments_tested, fragments);
+        if (span_buffer)
+            resolve_spans(clip);
+        STATS_ADD(depth_bytes, depth_planes || span_buffer ? 0 : fragments * sizeof(DepthStorage));
+        STATS_ADD(depth_bytes_uncompressed, fragments * sizeof(DepthStorage));
+        return fragments;
+    }
+
+    size_t draw(const vector<Triangle> &triangles, const vector<size_t> &indices, const PixelRect &rect) override
+    {
+        size_t fragments = 0;
+        PixelRect clip = sample_rect(rect);
+        STATS_ADD(triangles_in, indices.size());
+        for (size_t index : indices)
+            fragments += scan_triangle<true>(triangles[index], clip);
+        STATS_ADD(fragments_tested, fragments);
+        if (span_buffer)
+            resolve_spans(clip);
+        STATS_ADD(depth_bytes, depth_planes || span_buffer ? 0 : fragments * sizeof(DepthStorage));
+        STATS_ADD(depth_bytes_uncompressed, fragments * sizeof(DepthStorage));
+        return fragments;
+    }
+
+    PixelRect footprint(const Triangle &triangle, double *z_nearest = nullptr) override
+    {
+        PixelRect touched;
+        scan_triangle<false>(triangle, sample_rect(screen_rect(config)), &touched, z_nearest);
+        if (touched.empty())
+            return touched;
+        return PixelRect(touched.left / grid, touched.top / grid, touched.right / grid, touched.bottom / grid);
+    }
+
+    bool occlusion_query(const PixelRect &rect, double z_nearest) override
+    {
+        STATS_ADD(occlusion_queries, 1);
+
+        // Fragments nearer than z_min never pass, a passing one has to beat the stored depth
+        DepthStorage nearest = depth_format.encode(max(z_nearest, (double)z_min));
+        PixelRect samples = sample_rect(rect);
+        for (int row = max(samples.top, 0); row <= min(samples.bottom, screen_height - 1); row++)
+            for (int column = max(samples.left, 0); column <= min(samples.right, screen_width - 1); column++)
+                if (stored_depth(row, column) > nearest)
+                    return true;
+
+        STATS_ADD(occlusion_hidden, 1);
+        return false;
+    }
+
+    // Resolve samples into the output z-buffer (nearest sample) and image (average color)
+    void resolve(vector<vector<double>> &z_buffer, bitmap_image &image, bool release = false) override
+    {
+        // Translucent layers are blended into a copy, the buffers stay valid for further drawing
+        bitmap_image composited;
+        vector<DepthStorage> nearest_fragment;
+        if (abuffer_fragments)
+            composite_fragments(composited, nearest_fragment);
+        bitmap_image &samples = abuffer_fragments ? composited : sample_image;
+
+        bool resolved = false;
+        if constexpr (Samples == 1 && is_same<DepthStorage, double>::value)
+            if (!depth_planes)
+            {
+                if (release)
+                    z_buffer.swap(depth_buffer);
+                else
+                    z_buffer = depth_buffer;
+                resolved = true;
+            }
+
+        if (!resolved)
+        {
+            z_buffer.assign(config.screen_height, vector<double>(config.screen_width, config.z_max));
+            for (int y = 0; y < screen_height; y++)
+                for (int x = 0; x < screen_width; x++)
+                {
+                    DepthStorage depth = stored_depth(y, x);
+                    if (depth < cleared_depth)
+                        z_buffer[y / grid][x / grid] = min(z_buffer[y / grid][x / grid], depth_format.decode(depth));
+                }
+        }
+
+        // The z-buffer holds the nearest surface, translucent or not
+        for (size_t sample = 0; sample < nearest_fragment.size(); sample++)
+            if (nearest_fragment[sample] < cleared_depth)
+            {
+                double &z = z_buffer[sample / screen_width / grid][sample % screen_width / grid];
+                z = min(z, depth_format.decode(nearest_fragment[sample]));
+            }
+
+        STATS_ADD(depth_tiles, depth_tiles.size());
+        for (const DepthTile &tile : depth_tiles)
+            STATS_ADD(depth_tiles_compressed, tile.samples.empty());
+
+        if (Samples == 1)
+        {
+            image = samples;
+            return;
+        }
+
+        image.setwidth_height(config.screen_width, config.screen_height);
+        for (unsigned int y = 0; y < image.height(); y++)
+            for (unsigned int x = 0; x < image.width(); x++)
+            {
+                int red = 0, green = 0, blue = 0;
+                for (int sy = 0; sy < grid; sy++)
+                    for (int sx = 0; sx < grid; sx++)
+                    {
+                        unsigned char r, g, b;
+                        samples.get_pixel(x * grid + sx, y * grid + sy, r, g, b);
+                        red += r, green += g, blue += b;
+                    }
+                image.set_pixel(x, y, red / Samples, green / Samples, blue / Samples);
+            }
+    }
+};
+
+// Picks the specialization matching the runtime configuration
+template <typename Scalar, typename DepthFormat, CullMode Cull>
+unique_ptr<Rasterizer> make_rasterizer_with_samples(const RasterConfig &config)
+{
+    if (config.samples == 4)
+        return make_unique<SpecializedRasterizer<Scalar, DepthFormat, Cull, 4>>(config);
+    return make_unique<SpecializedRasterizer<Scalar, DepthFormat, Cull, 1>>(config);
+}
+
+template <typename Scalar, typename DepthFormat>
+unique_ptr<Rasterizer> make_rasterizer_with_culling(const RasterConfig &config)
+{
+    switch (config.cull_mode)
+    {
+    case CullMode::BACK:
+        return make_rasterizer_with_samples<Scalar, DepthFormat, CullMode::BACK>(config);
+    case CullMode::FRONT:
+        return make_rasterizer_with_samples<Scalar, DepthFormat, CullMode::FRONT>(config);
+    default:
+        return make_rasterizer_with_samples<Scalar, DepthFormat, CullMode::NONE>(config);
+    }
+}
+
+template <typename Scalar>
+unique_ptr<Rasterizer> make_rasterizer_with_depth_format(const RasterConfig &config)
+{
+    if (config.depth_format == "float32")
+        return make_rasterizer_with_culling<Scalar, DepthFloat32>(config);
+    if (config.depth_format == "unorm24")
+        return make_rasterizer_with_culling<Scalar, DepthUnorm24>(config);
+    return make_rasterizer_with_culling<Scalar, DepthFloat64>(config);
+}
+
+unique_ptr<Rasterizer> make_rasterizer(const RasterConfig &config)
+{
+    if (config.single_precision)
+        return make_rasterizer_with_depth_format<float>(config);
+    return make_rasterizer_with_depth_format<double>(config);
+}
+
+// Occlusion culled draw: draws the triangles in order, skipping every group whose footprint cannot pass the
+// depth test against what is already drawn. A hidden triangle would not have written anything, so the result
+// is unchanged. Returns the number of fragments depth tested.
+size_t draw_with_occlusion_culling(Rasterizer &rasterizer, const vector<Triangle> &triangles,
+                                   const vector<TriangleGroup> &groups, const PixelRect &rect)
+{
+    size_t fragments = 0;
+    vector<size_t> batch;
+
+    // Footprints are computed once, on the first query of a group containing the triangle
+    vector<PixelRect> footprints(triangles.size());
+    vector<double> nearest(triangles.size());
+    vector<char> bounded(triangles.size(), 0);
+
+    size_t group = 0;
+    for (size_t i = 0; i < triangles.size();)
+    {
+        // Groups starting here are queried outermost first
+        if (group < groups.size() && groups[group].begin == i)
+        {
+            const TriangleGroup &current = groups[group++];
+            if (current.begin == current.end)
+                continue;
+
+            // The query has to see everything drawn before the group
+            fragments += rasterizer.draw(triangles, batch, rect);
+            batch.clear();
+
+            PixelRect bounds;
+            double z_nearest = numeric_limits<double>::infinity();
+            for (size_t j = current.begin; j < current.end; j++)
+            {
+                if (!bounded[j])
+                {
+                    nearest[j] = numeric_limits<double>::infinity();
+                    footprints[j] = rasterizer.footprint(triangles[j], &nearest[j]);
+                    bounded[j] = 1;
+                }
+                const PixelRect &footprint = footprints[j];
+                if (footprint.empty())
+                    continue;
+                bounds = bounds.empty() ? footprint
+                                        : PixelRect(min(bounds.left, footprint.left), min(bounds.top, footprint.top),
+                                                    max(bounds.right, footprint.right), max(bounds.bottom, footprint.bottom));
+                z_nearest = min(z_nearest, nearest[j]);
+            }
+
+            if (!rasterizer.occlusion_query(bounds, z_nearest))
+            {
+                STATS_ADD(occlusion_triangles_skipped, current.end - current.begin);
+                i = current.end;
+                while (group < groups.size() && groups[group].begin < i)
+                    group++;
+            }
+            continue;
+        }
+        batch.push_back(i++);
+    }
+
+    fragments += rasterizer.draw(triangles, batch, rect);
+    return fragments;
+}
+
+// Scan converts the triangles into freshly initialized buffers, returns the number of fragments depth tested
+size_t rasterize(vector<Triangle> &triangles, const RasterConfig &config,
+                 vector<vector<double>> &z_buffer, bitmap_image &image, const vector<TriangleGroup> &groups = {})
+{
+    for (Triangle &triangle : triangles)
+        triangle.set_random_colors();
+
+    unique_ptr<Rasterizer> rasterizer = make_rasterizer(config);
+
+    size_t fragments;
+    {
+        STATS_TIME(rasterization);
+        if (config.occlusion_culling)
+            fragments = draw_with_occlusion_culling(*rasterizer, triangles, groups, screen_rect(config));
+        else
+            fragments = rasterizer->draw(triangles, screen_rect(config));
+    }
+    rasterizer->resolve(z_buffer, image, true);
+    return fragments;
+}
+
+// One frame of a multi-view render: projected triangles in, resolved buffers out
+class ViewFrame
+{
+public:
+    vector<Triangle> triangles;
+    vector<TriangleGroup> groups;
+    vector<vector<double>> z_buffer;
+    bitmap_image image;
+};
+
+// Rows of a frame drawn by one work item of rasterize_views
+constexpr int VIEW_BAND_ROWS = 32;
+
+// Draws colored frames with one configuration on a shared pool of worker threads. Every frame is binned into
+// bands of rows and each (frame, band) pair is a work item; bands are disjoint, so a frame comes out exactly
+// as rasterize would draw it. Occlusion queries read depth anywhere in a group's bounds and the A-buffer pool
+// is shared by the whole frame, so with either a whole frame is one work item.
+void rasterize_views(vector<ViewFrame> &frames, const RasterConfig &config, unsigned int num_threads)
+{
+    int height = config.screen_height;
+    bool whole_frames = config.occlusion_culling || config.abuffer_fragments;
+    int band_rows = whole_frames ? height : VIEW_BAND_ROWS;
+    int bands = (height + band_rows - 1) / band_rows;
+    double pixel_height = (config.top_limit - config.bottom_limit) / config.screen_height;
+
+    vector<unique_ptr<Rasterizer>> rasterizers;
+    vector<vector<vector<size_t>>> bins(frames.size(), vector<vector<size_t>>(bands));
+    for (size_t f = 0; f < frames.size(); f++)
+    {
+        rasterizers.push_back(make_rasterizer(config));
+        if (whole_frames)
+            continue;
+
+        // Rows between the vertices' heights, one row of margin for the rounding of scanlines
+        const vector<Triangle> &triangles = frames[f].triangles;
+        for (size_t i = 0; i < triangles.size(); i++)
+        {
+            double y_min = triangles[i].vertices[0].elements[1][0], y_max = y_min;
+            for (int k = 1; k < 3; k++)
+            {
+                y_min = min(y_min, triangles[i].vertices[k].elements[1][0]);
+                y_max = max(y_max, triangles[i].vertices[k].elements[1][0]);
+            }
+            int first_row = max(0.0, floor((config.top_limit - y_max) / pixel_height - 0.5) - 1);
+            int last_row = min(height - 1.0, ceil((config.top_limit - y_min) / pixel_height - 0.5) + 1);
+            for (int band = first_row / band_rows; first_row <= last_row && band <= last_row / band_rows; band++)
+                bins[f][band].push_back(i);
+        }
+    }
+
+    size_t items = frames.size() * bands;
+    atomic<size_t> next_item(0);
+#ifdef RASTER_STATS
+    vector<RenderStats> worker_stats(max(1u, num_threads));
+#endif
+
+    auto worker = [&](unsigned int id)
+    {
+        for (size_t item = next_item++; item < items; item = next_item++)
+        {
+            // Band major, so the frames progress together
+            size_t f = item % frames.size();
+            int band = item / frames.size();
+            PixelRect rect(0, band * band_rows, config.screen_width - 1, min((band + 1) * band_rows, height) - 1);
+
+            STATS_TIME(rasterization);
+            if (config.occlusion_culling)
+                draw_with_occlusion_culling(*rasterizers[f], frames[f].triangles, frames[f].groups, rect);
+            else if (whole_frames)
+                rasterizers[f]->draw(frames[f].triangles, rect);
+            else
+                rasterizers[f]->draw(frames[f].triangles, bins[f][band], rect);
+        }
+#ifdef RASTER_STATS
+        worker_stats[id] = render_stats;
+#else
+        (void)id;
+#endif
+    };
+
+    num_threads = max(1u, min<unsigned int>(num_threads, items));
+    vector<thread> workers;
+    for (unsigned int i = 0; i < num_threads; i++)
+        workers.emplace_back(worker, i);
+    for (auto &t : workers)
+        t.join();
+
+#ifdef RASTER_STATS
+    for (const RenderStats &stats : worker_stats)
+        render_stats += stats;
+#endif
+
+    for (size_t f = 0; f < frames.size(); f++)
+        rasterizers[f]->resolve(frames[f].z_buffer, frames[f].image, true);
+}
+
+// Writes out<suffix>.bmp and z_buffer<suffix>.txt
+void save_outputs(vector<vector<double>> &z_buffer, bitmap_image &image, const RasterConfig &config, const string &directory,
+                  const string &suffix = "")
+{
+    double screen_width = config.screen_width, screen_height = config.screen_height;
+    double z_max = config.z_max;
+
+    // Output streams
+    ofstream z_buffer_stream(directory + "/z_buffer" + suffix + ".txt");
+    z_buffer_stream << fixed << setprecision(6);
+
     // Sub-task-4: Save image and z_buffer
-    image.save_image("out.bmp");
+    {
+        STATS_TIME(image);
+        image.save_image(directory + "/out" + suffix + ".bmp");
+    }
 
+    STATS_TIME(z_buffer);
     for (int i = 0; i < screen_height; i++)
     {
         for (int j = 0; j < screen_width; j++)
         {
             if (z_buffer[i][j] >= z_max)
                 continue;
+            STATS_ADD(pixels_covered, 1);
             z_buffer_stream << z_buffer[i][j] << "\t";
         }
         z_buffer_stream << endl;
@@ -194,8 +1590,15 @@ void rasterization(vector<Triangle> &triangles)
     image.clear();
 
     // All file streams closed
-    config_stream.close();
     z_buffer_stream.close();
+}
+
+void rasterization(vector<Triangle> &triangles, const RasterConfig &config, const string &directory = ".",
+                   const vector<TriangleGroup> &groups = {})
+{
+    vector<vector<double>> z_buffer;
+    bitmap_image image;
 
-    return;
+    rasterize(triangles, config, z_buffer, image, groups);
+    save_outputs(z_buffer, image, config, directory);
 }
\ No newline at end of file
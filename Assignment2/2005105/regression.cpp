@@ -0,0 +1,357 @@
+#include <map>
+#include <sstream>
+
+#include "session.cpp"
+
+using namespace std;
+
+// Usage:
+//   regression [--cases GLOB] [--work-dir DIR] [--baseline DIR] [--update-baseline]
+//              [--tolerance T] [--pixels P]
+// Renders every test case into --work-dir and compares it against the reference outputs.
+// A file found under --baseline/<case>/ is the reference, otherwise the one stored with the test case.
+// Stage files and z_buffer.txt are compared entry by entry within --tolerance. Triangle colors are random,
+// so out.bmp is compared up to a recoloring: at most a share --pixels of its pixels may disagree, and a
+// diff.bmp marks them otherwise. --update-baseline only records cases whose stage files and z_buffer.txt
+// pass. Render times are printed against <baseline>/render_times.txt.
+// Every case also runs through a watch session whose config.txt loses its optional keys between two frames,
+// the second frame has to match a fresh render of the same files byte for byte.
+
+class Comparison
+{
+public:
+    bool passed = true;
+    string detail;
+};
+
+// Compares two whitespace separated numeric files line by line and entry by entry
+Comparison compare_numeric_file(const string &actual_path, const string &expected_path, double tolerance)
+{
+    Comparison result;
+    ifstream actual_stream(actual_path), expected_stream(expected_path);
+    if (!actual_stream.is_open() || !expected_stream.is_open())
+    {
+        result.passed = false;
+        result.detail = "missing " + (actual_stream.is_open() ? expected_path : actual_path);
+        return result;
+    }
+
+    size_t mismatches = 0, line_number = 0;
+    double max_error = 0;
+    string actual_line, expected_line;
+    while (true)
+    {
+        bool has_actual = (bool)getline(actual_stream, actual_line);
+        bool has_expected = (bool)getline(expected_stream, expected_line);
+        if (!has_actual && !has_expected)
+            break;
+        line_number++;
+
+        vector<double> actual_values, expected_values;
+        double value;
+        istringstream actual_tokens(has_actual ? actual_line : ""), expected_tokens(has_expected ? expected_line : "");
+        while (actual_tokens >> value)
+            actual_values.push_back(value);
+        while (expected_tokens >> value)
+            expected_values.push_back(value);
+
+        if (actual_values.size() != expected_values.size())
+        {
+            if (!mismatches++)
+                result.detail = "line " + to_string(line_number) + ": " + to_string(actual_values.size()) +
+                                " entries, expected " + to_string(expected_values.size());
+            continue;
+        }
+
+        for (size_t i = 0; i < actual_values.size(); i++)
+        {
+            double error = fabs(actual_values[i] - expected_values[i]);
+            max_error = max(max_error, error);
+            if (error > tolerance && !mismatches++)
+                result.detail = "line " + to_string(line_number) + " entry " + to_string(i + 1) + ": " +
+                                to_string(actual_values[i]) + ", expected " + to_string(expected_values[i]);
+        }
+    }
+
+    result.passed = mismatches == 0;
+    ostringstream summary;
+    summary << "max error " << scientific << setprecision(2) << max_error;
+    if (mismatches)
+        summary << ", " << mismatches << " mismatches, first at " << result.detail;
+    result.detail = summary.str();
+    return result;
+}
+
+// Compares images up to a recoloring. Every color of one image has to stand for a single color of the other,
+// both ways; a pixel disagreeing with the majority pairing of its colors is a mismatch. Mismatches may cover
+// at most max_mismatch of the pixels and are marked white in a diff image otherwise.
+Comparison compare_image(const string &actual_path, const string &expected_path, double max_mismatch, const string &diff_path)
+{
+    Comparison result;
+    bitmap_image actual(actual_path), expected(expected_path);
+    if (!actual || !expected)
+    {
+        result.passed = false;
+        result.detail = "unreadable " + (!actual ? actual_path : expected_path);
+        return result;
+    }
+    if (actual.width() != expected.width() || actual.height() != expected.height())
+    {
+        result.passed = false;
+        result.detail = "size " + to_string(actual.width()) + "x" + to_string(actual.height()) + ", expected " +
+                        to_string(expected.width()) + "x" + to_string(expected.height());
+        return result;
+    }
+
+    unsigned int width = actual.width(), height = actual.height();
+    vector<unsigned int> actual_colors(width * height), expected_colors(width * height);
+    for (unsigned int y = 0; y < height; y++)
+        for (unsigned int x = 0; x < width; x++)
+        {
+            unsigned char r, g, b;
+            actual.get_pixel(x, y, r, g, b);
+            actual_colors[y * width + x] = r << 16 | g << 8 | b;
+            expected.get_pixel(x, y, r, g, b);
+            expected_colors[y * width + x] = r << 16 | g << 8 | b;
+        }
+
+    // Majority partner of every color in each direction
+    auto pairing = [&](const vector<unsigned int> &from, const vector<unsigned int> &to)
+    {
+        map<unsigned int, map<unsigned int, size_t>> counts;
+        for (size_t i = 0; i < from.size(); i++)
+            counts[from[i]][to[i]]++;
+        map<unsigned int, unsigned int> partner;
+        for (const auto &entry : counts)
+        {
+            size_t best = 0;
+            for (const auto &candidate : entry.second)
+                if (candidate.second > best)
+                    best = candidate.second, partner[entry.first] = candidate.first;
+        }
+        return partner;
+    };
+    map<unsigned int, unsigned int> expected_partner = pairing(actual_colors, expected_colors);
+    map<unsigned int, unsigned int> actual_partner = pairing(expected_colors, actual_colors);
+
+    vector<char> mismatch(width * height);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < mismatch.size(); i++)
+    {
+        mismatch[i] = expected_partner[actual_colors[i]] != expected_colors[i] || actual_partner[expected_colors[i]] != actual_colors[i];
+        mismatches += mismatch[i];
+    }
+
+    double share = (double)mismatches / mismatch.size();
+    result.passed = share <= max_mismatch;
+
+    ostringstream summary;
+    summary << mismatches << " pixels off the recoloring (" << fixed << setprecision(3) << share * 100 << "%)";
+    if (!result.passed)
+    {
+        bitmap_image diff(width, height);
+        for (unsigned int y = 0; y < height; y++)
+            for (unsigned int x = 0; x < width; x++)
+            {
+                unsigned char value = mismatch[y * width + x] ? 255 : 0;
+                diff.set_pixel(x, y, value, value, value);
+            }
+        diff.save_image(diff_path);
+        summary << ", diff written to " << diff_path;
+    }
+    result.detail = summary.str();
+    return result;
+}
+
+bool same_file_contents(const string &a_path, const string &b_path)
+{
+    ifstream a_stream(a_path, ios::binary), b_stream(b_path, ios::binary);
+    stringstream a_buffer, b_buffer;
+    a_buffer << a_stream.rdbuf();
+    b_buffer << b_stream.rdbuf();
+    return a_stream.is_open() && b_stream.is_open() && a_buffer.str() == b_buffer.str();
+}
+
+// Optional config keys set for the first watch frame and removed for the second
+const string WATCH_FIRST_FRAME_KEYS = "cull front\nsamples 4\nprecision float\n";
+
+// Renders the case in a watch session with WATCH_FIRST_FRAME_KEYS appended to config.txt, then again with the
+// original config.txt, and compares the outputs with a fresh render of the original files
+Comparison check_watch_session(const string &case_directory, const string &output_directory)
+{
+    Comparison result;
+    string session_directory = output_directory + "/watch", fresh_directory = output_directory + "/watch_fresh";
+    for (const string &directory : {session_directory, fresh_directory})
+    {
+        filesystem::create_directories(directory);
+        for (string input : {"scene.txt", "config.txt"})
+            filesystem::copy_file(case_directory + "/" + input, directory + "/" + input, filesystem::copy_options::overwrite_existing);
+    }
+    ifstream config_stream(case_directory + "/config.txt");
+    stringstream config_text;
+    config_text << config_stream.rdbuf();
+
+    RenderSession session(session_directory);
+    ofstream(session_directory + "/config.txt") << config_text.str() << "\n" << WATCH_FIRST_FRAME_KEYS;
+    session.render();
+    ofstream(session_directory + "/config.txt") << config_text.str();
+    session.render();
+
+    RenderReport report;
+    render_scene(fresh_directory, report);
+
+    for (string file : {"z_buffer.txt", "out.bmp"})
+        if (!same_file_contents(session_directory + "/" + file, fresh_directory + "/" + file))
+        {
+            result.passed = false;
+            result.detail += (result.detail.empty() ? "" : ", ") + file + " differs from a fresh render";
+        }
+    if (result.passed)
+        result.detail = "second frame matches a fresh render";
+    return result;
+}
+
+map<string, double> read_render_times(const string &path)
+{
+    map<string, double> times;
+    ifstream times_stream(path);
+    string name;
+    double seconds;
+    while (times_stream >> name >> seconds)
+        times[name] = seconds;
+    return times;
+}
+
+void write_render_times(const string &path, const map<string, double> &times)
+{
+    ofstream times_stream(path);
+    times_stream << fixed << setprecision(6);
+    for (const auto &entry : times)
+        times_stream << entry.first << " " << entry.second << endl;
+}
+
+int main(int argc, char **argv)
+{
+    string cases = "../Offline 2/test_cases/*";
+    string work_directory = "regression_output";
+    string baseline_directory = "regression_baseline";
+    bool update_baseline = false;
+    double tolerance = 1e-5;
+    double max_mismatch = 0.001;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        if (option == "--update-baseline")
+            update_baseline = true;
+        else if (option == "--cases" && i + 1 < argc)
+            cases = argv[++i];
+        else if (option == "--work-dir" && i + 1 < argc)
+            work_directory = argv[++i];
+        else if (option == "--baseline" && i + 1 < argc)
+            baseline_directory = argv[++i];
+        else if (option == "--tolerance" && i + 1 < argc)
+            tolerance = stod(argv[++i]);
+        else if (option == "--pixels" && i + 1 < argc)
+            max_mismatch = stod(argv[++i]);
+        else
+        {
+            cerr << "Unknown option: " << option << endl;
+            return -1;
+        }
+    }
+
+    vector<string> case_directories = expand_scene_directories({cases});
+    if (case_directories.empty())
+        return -1;
+
+    string times_path = baseline_directory + "/render_times.txt";
+    map<string, double> baseline_times = read_render_times(times_path);
+
+    const vector<string> text_outputs = {"stage1.txt", "stage2.txt", "stage3.txt", "z_buffer.txt"};
+    int failed_cases = 0;
+
+    for (const string &case_directory : case_directories)
+    {
+        string name = filesystem::path(case_directory).filename().string();
+        string output_directory = work_directory + "/" + name;
+        string baseline_case_directory = baseline_directory + "/" + name;
+
+        filesystem::create_directories(output_directory);
+        for (string input : {"scene.txt", "config.txt"})
+            filesystem::copy_file(case_directory + "/" + input, output_directory + "/" + input,
+                                  filesystem::copy_options::overwrite_existing);
+
+        RenderReport report;
+        try
+        {
+            render_scene(output_directory, report);
+        }
+        catch (const exception &e)
+        {
+            cout << "FAIL  " << name << "  " << e.what() << endl;
+            failed_cases++;
+            continue;
+        }
+
+        auto reference = [&](const string &file)
+        {
+            string baseline_file = baseline_case_directory + "/" + file;
+            return filesystem::exists(baseline_file) ? baseline_file : case_directory + "/" + file;
+        };
+
+        vector<pair<string, Comparison>> comparisons;
+        for (const string &file : text_outputs)
+            comparisons.emplace_back(file, compare_numeric_file(output_directory + "/" + file, reference(file), tolerance));
+        bool text_passed = true;
+        for (const auto &comparison : comparisons)
+            text_passed = text_passed && comparison.second.passed;
+        comparisons.emplace_back("out.bmp", compare_image(output_directory + "/out.bmp", reference("out.bmp"),
+                                                          max_mismatch, output_directory + "/diff.bmp"));
+        bool passed = text_passed && comparisons.back().second.passed;
+
+        try
+        {
+            comparisons.emplace_back("watch", check_watch_session(case_directory, output_directory));
+        }
+        catch (const exception &e)
+        {
+            comparisons.emplace_back("watch", Comparison{false, e.what()});
+        }
+        passed = passed && comparisons.back().second.passed;
+
+        cout << (passed ? "PASS  " : "FAIL  ") << name << "  " << fixed << setprecision(3)
+             << report.seconds * 1000 << " ms";
+        if (baseline_times.count(name))
+            cout << " (baseline " << baseline_times[name] * 1000 << " ms, "
+                 << showpos << (report.seconds / baseline_times[name] - 1) * 100 << noshowpos << "%)";
+        cout << endl;
+        for (const auto &comparison : comparisons)
+            cout << "      " << (comparison.second.passed ? "ok   " : "FAIL ") << comparison.first << "  "
+                 << comparison.second.detail << endl;
+
+        if (!passed)
+            failed_cases++;
+
+        // The stage files and z-buffer are deterministic, a run that changes them is a regression, not a baseline
+        if (update_baseline && !text_passed)
+            cout << "      baseline of " << name << " not updated, its stage files or z_buffer.txt differ" << endl;
+        else if (update_baseline)
+        {
+            filesystem::create_directories(baseline_case_directory);
+            for (string file : {"stage1.txt", "stage2.txt", "stage3.txt", "z_buffer.txt", "out.bmp"})
+                filesystem::copy_file(output_directory + "/" + file, baseline_case_directory + "/" + file,
+                                      filesystem::copy_options::overwrite_existing);
+            baseline_times[name] = report.seconds;
+        }
+    }
+
+    if (update_baseline)
+    {
+        write_render_times(times_path, baseline_times);
+        cout << "Baseline updated in " << baseline_directory << endl;
+    }
+
+    cout << case_directories.size() - failed_cases << "/" << case_directories.size() << " cases passed" << endl;
+    return failed_cases ? -1 : 0;
+}
@@ -0,0 +1,175 @@
+#include <sstream>
+
+#include "batch.cpp"
+
+using namespace std;
+
+class SessionUpdate
+{
+public:
+    bool full_render = false;
+    size_t triangle_count = 0, changed_triangles = 0;
+    size_t dirty_tiles = 0, total_tiles = 0;
+    double seconds = 0;
+};
+
+// Keeps the framebuffer of the last render of a directory and, after an edit of scene.txt,
+// re-rasterizes only the tiles touched by added, removed or changed triangles.
+// Tiles are redrawn from scratch with every triangle overlapping them in scene order, so the
+// result is identical to a full render. A scene light's shadows are applied to the whole resolved
+// frame every time, since an edit anywhere can move them. Multi-view configs are rejected.
+class RenderSession
+{
+    string directory;
+    int tile_size;
+
+    bool has_frame = false;
+    string config_text;
+    RasterConfig config;
+    unique_ptr<Rasterizer> rasterizer;
+
+    // Projected triangles of the last frame and the pixels each one touches
+    vector<Triangle> triangles;
+    vector<PixelRect> footprints;
+
+    static bool same_triangle(const Triangle &a, const Triangle &b)
+    {
+        if (a.red != b.red || a.green != b.green || a.blue != b.blue || a.alpha != b.alpha || a.attributes != b.attributes)
+            return false;
+        for (int v = 0; v < 3; v++)
+            for (int k = 0; k < 3; k++)
+                if (a.vertices[v].elements[k][0] != b.vertices[v].elements[k][0])
+                    return false;
+        return true;
+    }
+
+public:
+    RenderSession(const string &directory, int tile_size = 32) : directory(directory), tile_size(tile_size) {}
+
+    SessionUpdate render()
+    {
+        auto start_time = chrono::steady_clock::now();
+        SessionUpdate update;
+
+        ifstream config_stream(directory + "/config.txt");
+        if (!config_stream.is_open())
+            throw invalid_argument("Unable to open " + directory + "/config.txt");
+        stringstream config_buffer;
+        config_buffer << config_stream.rdbuf();
+
+        // A new configuration invalidates the framebuffer
+        if (!has_frame || config_buffer.str() != config_text)
+        {
+            // Keys missing from the new file fall back to their defaults, as in a fresh render
+            config_text = config_buffer.str();
+            config = RasterConfig();
+            config_buffer >> config;
+            has_frame = false;
+        }
+        if (config.view_mode != ViewMode::SINGLE)
+            throw invalid_argument("watch renders a single view, remove \"views\" from config.txt");
+
+        vector<Triangle> next_triangles;
+        SceneInfo scene;
+        transform_scene(directory, next_triangles, numeric_limits<size_t>::max(), &scene, config.screen_height);
+
+        fastrand_seed();
+        for (Triangle &triangle : next_triangles)
+            triangle.set_random_colors();
+
+        int tiles_x = ((int)config.screen_width + tile_size - 1) / tile_size;
+        int tiles_y = ((int)config.screen_height + tile_size - 1) / tile_size;
+        update.total_tiles = tiles_x * tiles_y;
+        update.triangle_count = next_triangles.size();
+
+        if (!has_frame)
+        {
+            rasterizer = make_rasterizer(config);
+            rasterizer->draw(next_triangles, screen_rect(config));
+
+            footprints.clear();
+            for (const Triangle &triangle : next_triangles)
+                footprints.push_back(rasterizer->footprint(triangle));
+
+            update.full_render = true;
+            update.changed_triangles = next_triangles.size();
+            update.dirty_tiles = update.total_tiles;
+        }
+        else
+        {
+            vector<char> dirty(update.total_tiles, 0);
+            auto mark_dirty = [&](const PixelRect &rect)
+            {
+                if (rect.empty())
+                    return;
+                for (int ty = rect.top / tile_size; ty <= rect.bottom / tile_size; ty++)
+                    for (int tx = rect.left / tile_size; tx <= rect.right / tile_size; tx++)
+                        dirty[ty * tiles_x + tx] = 1;
+            };
+
+            // Diff by position in the scene, colors follow the position too
+            vector<PixelRect> next_footprints(next_triangles.size());
+            for (size_t i = 0; i < max(triangles.size(), next_triangles.size()); i++)
+            {
+                bool in_old = i < triangles.size(), in_new = i < next_triangles.size();
+                if (in_old && in_new && same_triangle(triangles[i], next_triangles[i]))
+                {
+                    next_footprints[i] = footprints[i];
+                    continue;
+                }
+
+                update.changed_triangles++;
+                if (in_old)
+                    mark_dirty(footprints[i]);
+                if (in_new)
+                {
+                    next_footprints[i] = rasterizer->footprint(next_triangles[i]);
+                    mark_dirty(next_footprints[i]);
+                }
+            }
+            footprints.swap(next_footprints);
+
+            // Bin every triangle into the dirty tiles it overlaps, keeping scene order
+            vector<vector<size_t>> bins(update.total_tiles);
+            for (size_t i = 0; i < next_triangles.size(); i++)
+            {
+                const PixelRect &rect = footprints[i];
+                if (rect.empty())
+                    continue;
+                for (int ty = rect.top / tile_size; ty <= rect.bottom / tile_size; ty++)
+                    for (int tx = rect.left / tile_size; tx <= rect.right / tile_size; tx++)
+                        if (dirty[ty * tiles_x + tx])
+                            bins[ty * tiles_x + tx].push_back(i);
+            }
+
+            for (size_t tile = 0; tile < update.total_tiles; tile++)
+            {
+                if (!dirty[tile])
+                    continue;
+                int tx = tile % tiles_x, ty = tile / tiles_x;
+                PixelRect rect(tx * tile_size, ty * tile_size,
+                               min((tx + 1) * tile_size, (int)config.screen_width) - 1,
+                               min((ty + 1) * tile_size, (int)config.screen_height) - 1);
+                rasterizer->clear(rect);
+                rasterizer->draw(next_triangles, bins[tile], rect);
+                update.dirty_tiles++;
+            }
+        }
+
+        triangles.swap(next_triangles);
+        has_frame = true;
+
+        vector<vector<double>> z_buffer;
+        bitmap_image image;
+        rasterizer->resolve(z_buffer, image);
+        if (scene.light.enabled)
+        {
+            ShadowMap shadow_map = render_shadow_map(scene.light_triangles, scene.light, config);
+            apply_shadows(z_buffer, image, config, scene.camera.matrix(), shadow_map);
+        }
+        save_outputs(z_buffer, image, config, directory);
+
+        update.seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        return update;
+    }
+};
@@ -0,0 +1,162 @@
+#include "rasterization.cpp"
+
+using namespace std;
+
+// Spot light of a "light" command in scene.txt, shadows are cast inside its frustum
+class SceneLight
+{
+public:
+    bool enabled = false;
+    Vector position, look;
+    double fovY = 90, near = 1, far = 100;
+
+    Matrix view() const
+    {
+        // Any up vector not parallel to the light direction
+        Vector direction = look - position;
+        Vector up = fabs(direction.y) > fabs(direction.x) + fabs(direction.z) ? Vector(1, 0, 0) : Vector(0, 1, 0);
+        return viewMatrix(position, look, up);
+    }
+
+    Matrix projection() const { return projectionMatrix(fovY, 1.0, near, far); }
+
+    // View followed by projection
+    Matrix matrix() const
+    {
+        Matrix light_view = view();
+        return projection() * light_view;
+    }
+};
+
+// Depth of the scene seen from the light, in the light's normalized device coordinates
+class ShadowMap
+{
+public:
+    Matrix light_matrix = Matrix(4, 4);
+    int resolution = 0;
+    vector<vector<double>> depth;
+};
+
+// Light space depth difference a fragment needs before it counts as shadowed, hides self shadowing
+const double SHADOW_BIAS = 0.002;
+// Share of the color left in full shadow
+const double SHADOW_AMBIENT = 0.35;
+// Points outside the light frustum, past light NDC +-1, count as lit apart from what the pcf kernel of a
+// point near its edge picks up from the edge texels, which the per texel bounds check allows. This looser
+// limit only keeps far away points out of the floor to int conversion of their texel
+const double SHADOW_LOOKUP_LIMIT = 2;
+
+Matrix invert_matrix(const Matrix &matrix)
+{
+    int n = matrix.row;
+    Matrix left = matrix, inverse = generateIdentityMatrix(n);
+    for (int column = 0; column < n; column++)
+    {
+        int pivot = column;
+        for (int r = column + 1; r < n; r++)
+            if (fabs(left.elements[r][column]) > fabs(left.elements[pivot][column]))
+                pivot = r;
+        if (fabs(left.elements[pivot][column]) <= numeric_limits<double>::epsilon())
+            throw invalid_argument("Matrix is singular");
+        swap(left.elements[column], left.elements[pivot]);
+        swap(inverse.elements[column], inverse.elements[pivot]);
+
+        double scale = left.elements[column][column];
+        for (int c = 0; c < n; c++)
+            left.elements[column][c] /= scale, inverse.elements[column][c] /= scale;
+
+        for (int r = 0; r < n; r++)
+        {
+            double factor = left.elements[r][column];
+            if (r == column || factor == 0)
+                continue;
+            for (int c = 0; c < n; c++)
+                left.elements[r][c] -= factor * left.elements[column][c], inverse.elements[r][c] -= factor * inverse.elements[column][c];
+        }
+    }
+    return inverse;
+}
+
+// Light pass: rasterizes the light space triangles into a square depth map with the regular z-buffer path
+ShadowMap render_shadow_map(const vector<Triangle> &light_triangles, const SceneLight &light, const RasterConfig &config)
+{
+    ShadowMap map;
+    map.light_matrix = light.matrix();
+    map.resolution = config.shadow_resolution;
+
+    // Same specialization as the main pass except culling, a triangle facing away from the light still casts
+    // a shadow. A-buffer, occlusion culling and views do not apply to a depth map
+    RasterConfig light_config;
+    light_config.single_precision = config.single_precision;
+    light_config.depth_format = config.depth_format;
+    light_config.samples = config.samples;
+    light_config.screen_width = light_config.screen_height = map.resolution;
+    light_config.left_limit = light_config.bottom_limit = -1;
+    light_config.right_limit = light_config.top_limit = 1;
+    light_config.z_min = -1, light_config.z_max = 1;
+
+    unique_ptr<Rasterizer> rasterizer = make_rasterizer(light_config);
+    rasterizer->draw(light_triangles, screen_rect(light_config));
+
+    bitmap_image image;
+    rasterizer->resolve(map.depth, image, true);
+    return map;
+}
+
+// Main pass lookup: every covered pixel is taken back to world space through its depth, projected into
+// the light and darkened by the share of the pcf x pcf shadow map texels around it that occlude it
+void apply_shadows(const vector<vector<double>> &z_buffer, bitmap_image &image, const RasterConfig &config,
+                   const Matrix &camera_matrix, const ShadowMap &map)
+{
+    Matrix light_inverse_camera = map.light_matrix;
+    Matrix inverse_camera = invert_matrix(camera_matrix);
+    light_inverse_camera = light_inverse_camera * inverse_camera;
+    const vector<vector<double>> &m = light_inverse_camera.elements;
+
+    int width = config.screen_width, height = config.screen_height;
+    double pixel_width = (config.right_limit - config.left_limit) / width;
+    double pixel_height = (config.top_limit - config.bottom_limit) / height;
+    int radius = config.shadow_pcf / 2;
+
+    for (int i = 0; i < height; i++)
+        for (int j = 0; j < width; j++)
+        {
+            double z = z_buffer[i][j];
+            if (z >= config.z_max)
+                continue;
+
+            double x = config.left_limit + (j + 0.5) * pixel_width, y = config.top_limit - (i + 0.5) * pixel_height;
+            double light_point[4];
+            for (int k = 0; k < 4; k++)
+                light_point[k] = m[k][0] * x + m[k][1] * y + m[k][2] * z + m[k][3];
+            if (light_point[3] <= 0)
+                continue;
+            double light_x = light_point[0] / light_point[3], light_y = light_point[1] / light_point[3];
+            double light_z = light_point[2] / light_point[3];
+            if (fabs(light_x) > SHADOW_LOOKUP_LIMIT || fabs(light_y) > SHADOW_LOOKUP_LIMIT)
+                continue;
+
+            // Texel of the light's depth map, rows counted from the top. Texels left at the far plane hold
+            // nothing and never occlude
+            int column = floor((light_x + 1) / 2 * map.resolution);
+            int row = floor((1 - light_y) / 2 * map.resolution);
+
+            int occluded = 0;
+            for (int dr = -radius; dr <= radius; dr++)
+                for (int dc = -radius; dc <= radius; dc++)
+                {
+                    int r = row + dr, c = column + dc;
+                    if (r >= 0 && r < map.resolution && c >= 0 && c < map.resolution && map.depth[r][c] < 1 &&
+                        light_z - SHADOW_BIAS > map.depth[r][c])
+                        occluded++;
+                }
+            if (!occluded)
+                continue;
+
+            double lit = 1 - (double)occluded / (config.shadow_pcf * config.shadow_pcf);
+            double scale = SHADOW_AMBIENT + (1 - SHADOW_AMBIENT) * lit;
+            unsigned char red, green, blue;
+            image.get_pixel(j, i, red, green, blue);
+            image.set_pixel(j, i, red * scale, green * scale, blue * scale);
+        }
+}
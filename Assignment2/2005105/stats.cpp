@@ -0,0 +1,130 @@
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+
+using namespace std;
+
+// Pipeline instrumentation, compiled in with -DRASTER_STATS.
+// Without it every STATS_* macro expands to nothing and adds no cost to the pipeline.
+#ifdef RASTER_STATS
+
+class RenderStats
+{
+public:
+    // Wall time per stage in seconds
+    double parsing_seconds = 0, view_seconds = 0, projection_seconds = 0;
+    double rasterization_seconds = 0, depth_test_seconds = 0;
+    double shadow_seconds = 0, image_seconds = 0, z_buffer_seconds = 0, total_seconds = 0;
+
+    size_t triangles_in = 0, triangles_culled = 0, triangles_rasterized = 0;
+    size_t scanlines = 0, fragments_tested = 0, fragments_passed = 0;
+    size_t pixels_covered = 0;
+
+    // Depth buffer traffic in bytes, and what one depth per sample would have cost
+    size_t depth_bytes = 0, depth_bytes_uncompressed = 0;
+    size_t depth_tiles = 0, depth_tiles_compressed = 0;
+
+    // Span buffer visibility, samples that needed a per-sample depth comparison
+    size_t spans = 0, span_samples_compared = 0;
+
+    // Occlusion queries, groups found hidden and the triangles they held
+    size_t occlusion_queries = 0, occlusion_hidden = 0, occlusion_triangles_skipped = 0;
+
+    // A-buffer fragments stored, most pool entries in use at once, fragments that found the pool exhausted
+    // and how many of those were merged into a stored fragment
+    size_t abuffer_stored = 0, abuffer_peak = 0, abuffer_overflows = 0, abuffer_merged = 0;
+
+    // Adds the counters and stage times of another thread
+    RenderStats &operator+=(const RenderStats &other)
+    {
+        parsing_seconds += other.parsing_seconds, view_seconds += other.view_seconds, projection_seconds += other.projection_seconds;
+        rasterization_seconds += other.rasterization_seconds, depth_test_seconds += other.depth_test_seconds;
+        shadow_seconds += other.shadow_seconds, image_seconds += other.image_seconds;
+        z_buffer_seconds += other.z_buffer_seconds, total_seconds += other.total_seconds;
+
+        triangles_in += other.triangles_in, triangles_culled += other.triangles_culled, triangles_rasterized += other.triangles_rasterized;
+        scanlines += other.scanlines, fragments_tested += other.fragments_tested, fragments_passed += other.fragments_passed;
+        pixels_covered += other.pixels_covered;
+        depth_bytes += other.depth_bytes, depth_bytes_uncompressed += other.depth_bytes_uncompressed;
+        depth_tiles += other.depth_tiles, depth_tiles_compressed += other.depth_tiles_compressed;
+        spans += other.spans, span_samples_compared += other.span_samples_compared;
+        occlusion_queries += other.occlusion_queries, occlusion_hidden += other.occlusion_hidden;
+        occlusion_triangles_skipped += other.occlusion_triangles_skipped;
+        abuffer_stored += other.abuffer_stored, abuffer_peak = max(abuffer_peak, other.abuffer_peak);
+        abuffer_overflows += other.abuffer_overflows, abuffer_merged += other.abuffer_merged;
+        return *this;
+    }
+
+    friend ostream &operator<<(ostream &output_stream, const RenderStats &stats)
+    {
+        double covered = stats.pixels_covered ? (double)stats.pixels_covered : 1.0;
+        ios_base::fmtflags flags = output_stream.flags();
+        streamsize precision = output_stream.precision();
+
+        output_stream << fixed << setprecision(6);
+        output_stream << "{\"seconds\":{\"parsing\":" << stats.parsing_seconds
+                      << ",\"view\":" << stats.view_seconds
+                      << ",\"projection\":" << stats.projection_seconds
+                      << ",\"scanline_setup\":" << stats.rasterization_seconds - stats.depth_test_seconds
+                      << ",\"depth_test\":" << stats.depth_test_seconds
+                      << ",\"shadow\":" << stats.shadow_seconds
+                      << ",\"image\":" << stats.image_seconds
+                      << ",\"z_buffer\":" << stats.z_buffer_seconds
+                      << ",\"total\":" << stats.total_seconds << "}"
+                      << ",\"triangles\":{\"in\":" << stats.triangles_in
+                      << ",\"culled\":" << stats.triangles_culled
+                      << ",\"rasterized\":" << stats.triangles_rasterized << "}"
+                      << ",\"scanlines\":" << stats.scanlines
+                      << ",\"fragments\":{\"tested\":" << stats.fragments_tested
+                      << ",\"passed\":" << stats.fragments_passed << "}"
+                      << ",\"pixels_covered\":" << stats.pixels_covered
+                      << ",\"depth_complexity\":" << stats.fragments_tested / covered
+                      << ",\"average_overdraw\":" << stats.fragments_passed / covered
+                      << ",\"depth_traffic\":{\"bytes\":" << stats.depth_bytes
+                      << ",\"uncompressed_bytes\":" << stats.depth_bytes_uncompressed
+                      << ",\"tiles\":" << stats.depth_tiles
+                      << ",\"compressed_tiles\":" << stats.depth_tiles_compressed << "}"
+                      << ",\"spans\":{\"count\":" << stats.spans
+                      << ",\"samples_compared\":" << stats.span_samples_compared << "}"
+                      << ",\"occlusion\":{\"queries\":" << stats.occlusion_queries
+                      << ",\"visible\":" << stats.occlusion_queries - stats.occlusion_hidden
+                      << ",\"hidden\":" << stats.occlusion_hidden
+                      << ",\"triangles_skipped\":" << stats.occlusion_triangles_skipped << "}"
+                      << ",\"abuffer\":{\"fragments\":" << stats.abuffer_stored
+                      << ",\"peak\":" << stats.abuffer_peak
+                      << ",\"overflows\":" << stats.abuffer_overflows
+                      << ",\"merged\":" << stats.abuffer_merged << "}}";
+
+        output_stream.flags(flags);
+        output_stream.precision(precision);
+        return output_stream;
+    }
+};
+
+// Accumulates the lifetime of the enclosing scope into a stats field
+class StageTimer
+{
+public:
+    double &total;
+    chrono::steady_clock::time_point start;
+
+    StageTimer(double &total) : total(total), start(chrono::steady_clock::now()) {}
+    ~StageTimer() { total += chrono::duration<double>(chrono::steady_clock::now() - start).count(); }
+};
+
+// One set of counters per thread so batch jobs do not share them
+thread_local RenderStats render_stats;
+
+#define STATS_RESET() (render_stats = RenderStats())
+#define STATS_ADD(counter, amount) (render_stats.counter += (amount))
+#define STATS_TIME(stage) StageTimer stats_timer_##stage(render_stats.stage##_seconds)
+#define STATS_MAX(counter, value) (render_stats.counter = max<size_t>(render_stats.counter, (value)))
+
+#else
+
+#define STATS_RESET() ((void)0)
+#define STATS_ADD(counter, amount) ((void)sizeof(amount))
+#define STATS_TIME(stage) ((void)0)
+#define STATS_MAX(counter, value) ((void)sizeof(value))
+
+#endif
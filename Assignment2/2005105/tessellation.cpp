@@ -0,0 +1,131 @@
+#include "shadows.cpp"
+
+using namespace std;
+
+// Chooses how finely procedural primitives are tessellated from their size on screen, so that the
+// triangle count of a primitive follows the pixels it covers
+class TessellationView
+{
+public:
+    Vector eye;
+    double fovY = 0, screen_height = 0;
+
+    // Target edge length in pixels and the segment limits around a full circle
+    static constexpr double EDGE_PIXELS = 8;
+    static constexpr int MIN_SEGMENTS = 6, MAX_SEGMENTS = 256;
+    // Used when no view is known
+    static constexpr int DEFAULT_SEGMENTS = 24;
+
+    TessellationView() {}
+    TessellationView(const Vector &eye, double fovY, double screen_height) : eye(eye), fovY(fovY), screen_height(screen_height) {}
+
+    // Segments around a circle of radius (object space) at center, placed in the world by transform
+    int segments(const Matrix &transform, const Vector &center, double radius) const
+    {
+        if (screen_height <= 0)
+            return DEFAULT_SEGMENTS;
+
+        Vector world_center(transform.elements[0][3], transform.elements[1][3], transform.elements[2][3]);
+        world_center = world_center + Vector(transform.elements[0][0] * center.x + transform.elements[0][1] * center.y + transform.elements[0][2] * center.z,
+                                             transform.elements[1][0] * center.x + transform.elements[1][1] * center.y + transform.elements[1][2] * center.z,
+                                             transform.elements[2][0] * center.x + transform.elements[2][1] * center.y + transform.elements[2][2] * center.z);
+
+        // Largest stretch of the transform
+        double scale = 0;
+        for (int j = 0; j < 3; j++)
+            scale = max(scale, sqrt(transform.elements[0][j] * transform.elements[0][j] + transform.elements[1][j] * transform.elements[1][j] +
+                                    transform.elements[2][j] * transform.elements[2][j]));
+        double world_radius = fabs(radius) * scale;
+
+        Vector offset = world_center - eye;
+        double distance = sqrt(offset.dot(offset));
+        if (distance <= world_radius)
+            return MAX_SEGMENTS;
+
+        // Projected circumference in pixels
+        double pixels_per_unit = screen_height / (2 * distance * tan(fovY * PI / 360.0));
+        double circumference = 2 * PI * world_radius * pixels_per_unit;
+        return max(MIN_SEGMENTS, min(MAX_SEGMENTS, (int)ceil(circumference / EDGE_PIXELS)));
+    }
+};
+
+Triangle make_triangle(const Vector &a, const Vector &b, const Vector &c)
+{
+    Triangle triangle;
+    const Vector *corners[3] = {&a, &b, &c};
+    for (int i = 0; i < 3; i++)
+    {
+        triangle.vertices[i].elements[0][0] = corners[i]->x;
+        triangle.vertices[i].elements[1][0] = corners[i]->y;
+        triangle.vertices[i].elements[2][0] = corners[i]->z;
+    }
+    return triangle;
+}
+
+// All primitives are wound counter-clockwise seen from outside
+
+// UV sphere with segments around the y axis and half as many rings
+vector<Triangle> tessellate_sphere(const Vector &center, double radius, int segments)
+{
+    int rings = max(3, segments / 2);
+    auto point = [&](int ring, int segment)
+    {
+        double theta = PI * ring / rings, phi = 2 * PI * segment / segments;
+        return center + Vector(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)) * radius;
+    };
+
+    vector<Triangle> triangles;
+    for (int i = 0; i < rings; i++)
+        for (int j = 0; j < segments; j++)
+        {
+            // Rings collapse to a point at the poles
+            if (i != 0)
+                triangles.push_back(make_triangle(point(i, j), point(i, j + 1), point(i + 1, j + 1)));
+            if (i != rings - 1)
+                triangles.push_back(make_triangle(point(i, j), point(i + 1, j + 1), point(i + 1, j)));
+        }
+    return triangles;
+}
+
+// Capped cylinder along the y axis, centered on center
+vector<Triangle> tessellate_cylinder(const Vector &center, double radius, double height, int segments)
+{
+    Vector top_center = center + Vector(0, height / 2, 0), bottom_center = center - Vector(0, height / 2, 0);
+    auto rim = [&](const Vector &cap, int segment)
+    {
+        double phi = 2 * PI * segment / segments;
+        return cap + Vector(cos(phi), 0, sin(phi)) * radius;
+    };
+
+    vector<Triangle> triangles;
+    for (int j = 0; j < segments; j++)
+    {
+        Vector top = rim(top_center, j), top_next = rim(top_center, j + 1);
+        Vector bottom = rim(bottom_center, j), bottom_next = rim(bottom_center, j + 1);
+        triangles.push_back(make_triangle(top, top_next, bottom_next));
+        triangles.push_back(make_triangle(top, bottom_next, bottom));
+        triangles.push_back(make_triangle(top_center, top_next, top));
+        triangles.push_back(make_triangle(bottom_center, bottom, bottom_next));
+    }
+    return triangles;
+}
+
+// Torus around the y axis, major_segments around the ring and minor_segments around the tube
+vector<Triangle> tessellate_torus(const Vector &center, double major_radius, double minor_radius, int major_segments, int minor_segments)
+{
+    auto point = [&](int major, int minor)
+    {
+        double u = 2 * PI * major / major_segments, v = 2 * PI * minor / minor_segments;
+        double distance = major_radius + minor_radius * cos(v);
+        return center + Vector(distance * cos(u), minor_radius * sin(v), distance * sin(u));
+    };
+
+    vector<Triangle> triangles;
+    for (int j = 0; j < major_segments; j++)
+        for (int k = 0; k < minor_segments; k++)
+        {
+            triangles.push_back(make_triangle(point(j, k), point(j, k + 1), point(j + 1, k + 1)));
+            triangles.push_back(make_triangle(point(j, k), point(j + 1, k + 1), point(j + 1, k)));
+        }
+    return triangles;
+}
@@ -1,6 +1,11 @@
 #include "data_structures.cpp"
 
-static unsigned long long int g_seed = 17;
+// Per-thread so that concurrent renders each reproduce the single-run color sequence
+static thread_local unsigned long long int g_seed = 17;
+inline void fastrand_seed(unsigned long long int seed = 17)
+{
+    g_seed = seed;
+}
 inline int fastrand()
 {
     g_seed = (214013 * g_seed + 2531011);
@@ -12,6 +17,13 @@ class Triangle
 public:
     vector<Matrix> vertices;
     unsigned char red, green, blue;
+    // Opacity, below 1 the triangle is blended when the rasterizer keeps an A-buffer
+    double alpha = 1;
+    // Per-vertex attributes, attributes[v * count + k] for count = size / 3. The first three are a color in
+    // 0..255 that replaces the flat one, empty for flat triangles
+    vector<double> attributes;
+    // 1/w of each vertex before the normalizations so far, for perspective-correct interpolation
+    double inverse_w[3] = {1, 1, 1};
 
     Triangle()
     {
@@ -22,9 +34,11 @@ public:
 
     void transform(const Matrix &m)
     {
-        for (Matrix &v : vertices)
+        for (int i = 0; i < 3; i++)
         {
-            v = m * v;                // Transformation
+            Matrix &v = vertices[i];
+            v = m * v; // Transformation
+            inverse_w[i] /= v.elements[3][0];
             v = v / v.elements[3][0]; // Normalization
         }
     }
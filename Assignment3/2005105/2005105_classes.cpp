@@ -1,6 +1,9 @@
 #include <GL/glut.h>
 #include <bits/stdc++.h>
 #include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -323,10 +326,135 @@ struct Ray
 {
     Vector origin, dir;
 
-    Ray(const Vector &start, const Vector &direction)
+    // normalized skips the sqrt for directions that are already unit length
+    Ray(const Vector &start, const Vector &direction, bool normalized = false)
     {
         origin = start;
-        dir = direction.normalize();
+        dir = normalized ? direction : direction.normalize();
+    }
+};
+
+class Object;
+
+// Result of a ray query. intersect fills t and the surface coordinates (u, v) it finds on the way, the
+// point, geometric normal and object are completed once for the closest hit.
+struct HitRecord
+{
+    double t = -1;
+    Vector point, normal;
+    double u = 0, v = 0;
+    const Object *object = nullptr;
+    // Face of a mesh
+    int primitive = -1;
+};
+
+// Rays traced together, stored by component so that the packet kernels can load two lanes at a time
+struct RayPacket
+{
+    static const int MAX_SIZE = 16;
+    int size = 0;
+    double ox[MAX_SIZE], oy[MAX_SIZE], oz[MAX_SIZE];
+    double dx[MAX_SIZE], dy[MAX_SIZE], dz[MAX_SIZE];
+
+    void add(const Ray &ray)
+    {
+        ox[size] = ray.origin.x, oy[size] = ray.origin.y, oz[size] = ray.origin.z;
+        dx[size] = ray.dir.x, dy[size] = ray.dir.y, dz[size] = ray.dir.z;
+        size++;
+    }
+
+    Ray ray(int lane) const
+    {
+        return Ray(Vector(ox[lane], oy[lane], oz[lane]), Vector(dx[lane], dy[lane], dz[lane]), true);
+    }
+};
+
+// Per lane results of a packet kernel, as intersect would fill them
+struct PacketHits
+{
+    double t[RayPacket::MAX_SIZE], u[RayPacket::MAX_SIZE], v[RayPacket::MAX_SIZE];
+    int primitive[RayPacket::MAX_SIZE];
+};
+
+#ifdef __SSE2__
+// Two lane helpers for the packet kernels. Each does the operations of the scalar expression it stands for in
+// the same order, so both paths give the same bits
+inline __m128d lanes_select(__m128d mask, __m128d a, __m128d b)
+{
+    return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+inline __m128d lanes_negate(__m128d a)
+{
+    return _mm_xor_pd(a, _mm_set1_pd(-0.0));
+}
+
+// ax * bx + ay * by + az * bz
+inline __m128d lanes_dot(__m128d ax, __m128d ay, __m128d az, __m128d bx, __m128d by, __m128d bz)
+{
+    return _mm_add_pd(_mm_add_pd(_mm_mul_pd(ax, bx), _mm_mul_pd(ay, by)), _mm_mul_pd(az, bz));
+}
+
+// a * b - c * d
+inline __m128d lanes_cross_term(__m128d a, __m128d b, __m128d c, __m128d d)
+{
+    return _mm_sub_pd(_mm_mul_pd(a, b), _mm_mul_pd(c, d));
+}
+#endif
+
+// Axis aligned bounding box
+struct AABB
+{
+    Vector lo, hi;
+
+    AABB() : lo(1e18, 1e18, 1e18), hi(-1e18, -1e18, -1e18) {}
+    AABB(const Vector &l, const Vector &h) : lo(l), hi(h) {}
+
+    void expand(const Vector &p)
+    {
+        lo = Vector(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+        hi = Vector(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+
+    void expand(const AABB &box)
+    {
+        expand(box.lo);
+        expand(box.hi);
+    }
+
+    Vector center() const
+    {
+        return (lo + hi) * 0.5;
+    }
+
+    double surface_area() const
+    {
+        Vector d = hi - lo;
+        if (d.x < 0 || d.y < 0 || d.z < 0)
+            return 0;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // Slab test, t_near receives the entry distance when the ray meets the box within (t_min, t_max)
+    bool intersect(const Ray &ray, const Vector &inv_dir, double t_min, double t_max, double &t_near) const
+    {
+        double t0 = (lo.x - ray.origin.x) * inv_dir.x, t1 = (hi.x - ray.origin.x) * inv_dir.x;
+        if (t0 > t1)
+            swap(t0, t1);
+        t_min = max(t_min, t0), t_max = min(t_max, t1);
+
+        t0 = (lo.y - ray.origin.y) * inv_dir.y, t1 = (hi.y - ray.origin.y) * inv_dir.y;
+        if (t0 > t1)
+            swap(t0, t1);
+        t_min = max(t_min, t0), t_max = min(t_max, t1);
+
+        t0 = (lo.z - ray.origin.z) * inv_dir.z, t1 = (hi.z - ray.origin.z) * inv_dir.z;
+        if (t0 > t1)
+            swap(t0, t1);
+        t_min = max(t_min, t0), t_max = min(t_max, t1);
+
+        t_near = t_min;
+        return t_min <= t_max;
     }
 };
 
@@ -385,6 +513,13 @@ struct SpotLight : public LightSource
     }
 };
 
+// Nearest hit with t_min < t < t_max, false when there is none. Ties go to the object listed first in objects.
+bool find_closest_hit(const Ray &ray, HitRecord &hit, double t_min = 0, double t_max = 1e9);
+// find_closest_hit for every lane of a packet, found[lane] tells whether hits[lane] holds a hit
+void find_closest_hits(const RayPacket &packet, HitRecord *hits, bool *found, double t_min = 0, double t_max = 1e9);
+// Whether any object is hit with t_min < t < t_max, stops at the first one found
+bool is_occluded(const Ray &ray, double t_min, double t_max);
+
 class Object
 {
 protected:
@@ -405,54 +540,43 @@ protected:
         return incident * ratio + normal * (ratio * cos_i - cos_t);
     }
 
-    int get_next_reflection_object(Ray reflected_ray) const
-    {
-        int nearest_id = -1;
-        double min_t = 1e9;
-        for (int i = 0; i < objects.size(); i++)
-        {
-            Object *obj = objects[i];
-            double t = obj->intersect(reflected_ray);
-            if (t > 0 && t < min_t)
-            {
-                min_t = t;
-                nearest_id = i;
-            }
-        }
-        return nearest_id;
-    }
-
 public:
     Object(const Vector &ref = Vector(0, 0, 0))
     {
         reference_point = ref;
     }
 
-    virtual Color get_color_at(const Vector &pt) const
+    virtual Color get_color_at(const HitRecord &hit) const
     {
         return color;
     }
 
-    virtual void shade(const Ray &ray, Color &col, int level) const
+    // Fills point, normal and object of a hit found by intersect
+    void complete_hit(const Ray &ray, HitRecord &hit) const
     {
-        if (level == 0)
-            return;
-
-        double t_hit = intersect(ray);
-        if (t_hit < 0)
-            return;
+        hit.point = ray.origin + ray.dir * hit.t;
+        hit.normal = get_normal(hit);
+        hit.object = this;
+    }
 
-        Vector intersect = ray.origin + ray.dir * t_hit;
-        Color base_color = get_color_at(intersect);
+    // Ambient, diffuse and specular light of a hit into col, returns the ray it reflects
+    Ray shade_direct(const Ray &ray, const HitRecord &hit, Color &col) const
+    {
+        const Vector &intersect = hit.point;
+        Color base_color = get_color_at(hit);
         col = base_color * phong_coefficients.ambient;
 
-        Vector normal = get_normal(intersect);
+        Vector normal = hit.normal;
         if (ray.dir.dot(normal) > 0)
             normal = -normal;
 
         for (auto light : light_sources)
         {
-            Ray l_ray(light->light_position, intersect - light->light_position);
+            Vector to_point = intersect - light->light_position;
+            double light_distance = to_point.norm();
+            if (light_distance <= EPS)
+                continue;
+            Ray l_ray(light->light_position, to_point / light_distance, true);
 
             double beta = 0;
             if (light->type == LightSource::SPOT)
@@ -465,21 +589,7 @@ public:
                     continue;
             }
 
-            double light_distance = (intersect - light->light_position).norm();
-            if (light_distance <= EPS)
-                continue;
-
-            bool shadowed = false;
-            for (auto obj : objects)
-            {
-                double t_shadow = obj->intersect(l_ray);
-                if (t_shadow > EPS && t_shadow + EPS < light_distance)
-                {
-                    shadowed = true;
-                    break;
-                }
-            }
-            if (shadowed)
+            if (is_occluded(l_ray, EPS, light_distance - EPS))
                 continue;
 
             double lambert = max(0.0, normal.dot(-l_ray.dir));
@@ -490,27 +600,101 @@ public:
 
             col += light->color * phong_coefficients.diffuse * lambert * base_color * falloff;
 
-            Ray r_ray(intersect, get_reflection(normal, l_ray.dir));
-            double phong = max(0.0, r_ray.dir.dot(-ray.dir));
+            // Reflections of unit vectors about the unit normal are unit vectors
+            Vector r_dir = get_reflection(normal, l_ray.dir);
+            double phong = max(0.0, r_dir.dot(-ray.dir));
             col += light->color * phong_coefficients.specular * pow(phong, phong_coefficients.shine) * base_color * falloff;
         }
 
+        Ray refl_ray(intersect, get_reflection(normal, ray.dir), true);
+        refl_ray.origin += refl_ray.dir * EPS;
+        return refl_ray;
+    }
+
+    virtual void shade(const Ray &ray, const HitRecord &hit, Color &col, int level) const
+    {
         if (level == 0)
             return;
 
-        Ray refl_ray(intersect, get_reflection(normal, ray.dir));
-        refl_ray.origin += refl_ray.dir * EPS;
-
-        int next_obj = get_next_reflection_object(refl_ray);
-        if (next_obj == -1)
+        Ray refl_ray = shade_direct(ray, hit, col);
+        HitRecord refl_hit;
+        if (!find_closest_hit(refl_ray, refl_hit))
             return;
 
         Color refl_color(0, 0, 0);
-        objects[next_obj]->shade(refl_ray, refl_color, level - 1);
+        refl_hit.object->shade(refl_ray, refl_hit, refl_color, level - 1);
         col += refl_color * phong_coefficients.reflection;
     }
 
-    virtual double intersect(Ray ray) const = 0;
+    // Cosine of the widest angle between reflections that are still traced as one packet
+    static constexpr double COHERENT_COS = 0.9;
+
+    // shade for the lanes of a packet that found a hit. The reflections stay in a packet while they leave
+    // the same object in similar directions, otherwise they are traced ray by ray
+    static void shade_packet(const RayPacket &packet, const HitRecord *hits, const bool *found, Color *colors, int level)
+    {
+        if (level == 0)
+            return;
+
+        RayPacket reflected;
+        int lanes[RayPacket::MAX_SIZE];
+        for (int lane = 0; lane < packet.size; lane++)
+            if (found[lane])
+            {
+                lanes[reflected.size] = lane;
+                reflected.add(hits[lane].object->shade_direct(packet.ray(lane), hits[lane], colors[lane]));
+            }
+
+        bool coherent = reflected.size > 1;
+        for (int k = 1; coherent && k < reflected.size; k++)
+            coherent = hits[lanes[k]].object == hits[lanes[0]].object &&
+                       reflected.dx[k] * reflected.dx[0] + reflected.dy[k] * reflected.dy[0] + reflected.dz[k] * reflected.dz[0] >= COHERENT_COS;
+
+        HitRecord refl_hits[RayPacket::MAX_SIZE];
+        bool refl_found[RayPacket::MAX_SIZE];
+        Color refl_colors[RayPacket::MAX_SIZE];
+        if (coherent)
+        {
+            find_closest_hits(reflected, refl_hits, refl_found);
+            shade_packet(reflected, refl_hits, refl_found, refl_colors, level - 1);
+        }
+        else
+        {
+            for (int k = 0; k < reflected.size; k++)
+            {
+                Ray refl_ray = reflected.ray(k);
+                refl_found[k] = find_closest_hit(refl_ray, refl_hits[k]);
+                if (refl_found[k])
+                    refl_hits[k].object->shade(refl_ray, refl_hits[k], refl_colors[k], level - 1);
+            }
+        }
+
+        for (int k = 0; k < reflected.size; k++)
+            if (refl_found[k])
+                colors[lanes[k]] += refl_colors[k] * hits[lanes[k]].object->phong_coefficients.reflection;
+    }
+
+    // Distance to the nearest hit in front of the origin or -1, also fills hit.t, hit.u and hit.v
+    virtual double intersect(const Ray &ray, HitRecord &hit) const = 0;
+
+    // intersect for every lane of the packet, the default traces them one by one
+    virtual void intersect_packet(const RayPacket &packet, PacketHits &hits) const
+    {
+        for (int lane = 0; lane < packet.size; lane++)
+        {
+            HitRecord hit;
+            hits.t[lane] = intersect(packet.ray(lane), hit);
+            hits.u[lane] = hit.u, hits.v[lane] = hit.v, hits.primitive[lane] = hit.primitive;
+        }
+    }
+
+    // Any-hit query for shadow rays
+    virtual bool occluded(const Ray &ray, double t_min, double t_max) const
+    {
+        HitRecord hit;
+        double t = intersect(ray, hit);
+        return t > t_min && t < t_max;
+    }
 
     void set_color(double r, double g, double b)
     {
@@ -528,7 +712,15 @@ public:
     }
 
     virtual void draw() const = 0;
-    virtual Vector get_normal(const Vector &point) const = 0;
+    // Geometric normal at hit.point
+    virtual Vector get_normal(const HitRecord &hit) const = 0;
+
+    // Box enclosing every point intersect can return, false for unbounded objects
+    virtual bool get_bounds(AABB &) const
+    {
+        return false;
+    }
+
     virtual ~Object() {}
 };
 
@@ -566,22 +758,25 @@ public:
         glPopMatrix();
     }
 
-    Vector get_normal(const Vector &) const override
+    Vector get_normal(const HitRecord &) const override
     {
         return Vector(0, 0, 1);
     }
 
-    Color get_color_at(const Vector &pt) const override
+    bool get_bounds(AABB &box) const override
+    {
+        box = AABB(reference_point, reference_point + Vector(floor_width, floor_width, 0));
+        return true;
+    }
+
+    Color get_color_at(const HitRecord &hit) const override
     {
         if (texture_mode)
         {
             const int repeat_factor = 10;
 
-            double u = (pt.x - reference_point.x) / floor_width;
-            double v = (pt.y - reference_point.y) / floor_width;
-
-            u = fmod(u * repeat_factor, 1.0);
-            v = fmod(v * repeat_factor, 1.0);
+            double u = fmod(hit.u * repeat_factor, 1.0);
+            double v = fmod(hit.v * repeat_factor, 1.0);
 
             if (u < 0)
                 u += 1.0;
@@ -592,15 +787,15 @@ public:
         }
         else
         {
-            int i = (pt.x - reference_point.x) / tile_width;
-            int j = (pt.y - reference_point.y) / tile_width;
+            int i = (hit.point.x - reference_point.x) / tile_width;
+            int j = (hit.point.y - reference_point.y) / tile_width;
             return ((i + j) % 2 == 0) ? Color(0, 0, 0) : Color(1, 1, 1);
         }
     }
 
-    double intersect(Ray ray) const override
+    double intersect(const Ray &ray, HitRecord &record) const override
     {
-        Vector n = get_normal(reference_point);
+        Vector n(0, 0, 1);
         double denom = n.dot(ray.dir);
         if (fabs(denom) < EPS)
             return -1.0;
@@ -611,6 +806,10 @@ public:
         if (hit.x < reference_point.x || hit.x > reference_point.x + floor_width ||
             hit.y < reference_point.y || hit.y > reference_point.y + floor_width)
             return -1.0;
+
+        record.t = t;
+        record.u = (hit.x - reference_point.x) / floor_width;
+        record.v = (hit.y - reference_point.y) / floor_width;
         return t;
     }
 };
@@ -631,12 +830,19 @@ public:
         glPopMatrix();
     }
 
-    Vector get_normal(const Vector &p) const override
+    Vector get_normal(const HitRecord &hit) const override
     {
-        return (p - reference_point).normalize();
+        return (hit.point - reference_point).normalize();
     }
 
-    double intersect(Ray ray) const override
+    bool get_bounds(AABB &box) const override
+    {
+        Vector extent(radius, radius, radius);
+        box = AABB(reference_point - extent, reference_point + extent);
+        return true;
+    }
+
+    double intersect(const Ray &ray, HitRecord &hit) const override
     {
         Vector L = ray.origin - reference_point;
         double b = 2 * ray.dir.dot(L);
@@ -650,21 +856,187 @@ public:
         double t2 = (-b + sqrt(delta)) / 2;
 
         if (t1 >= 0 && t2 >= 0)
-            return min(t1, t2);
-        if (t1 >= 0)
-            return t1;
-        if (t2 >= 0)
-            return t2;
+            hit.t = min(t1, t2);
+        else if (t1 >= 0)
+            hit.t = t1;
+        else if (t2 >= 0)
+            hit.t = t2;
+        else
+            return -1.0;
+        return hit.t;
+    }
+
+    // Same arithmetic as intersect with selects in place of branches, two lanes at a time with SSE2
+    void intersect_packet(const RayPacket &packet, PacketHits &hits) const override
+    {
+        int lane = 0;
+#ifdef __SSE2__
+        const __m128d zero = _mm_setzero_pd(), miss = _mm_set1_pd(-1.0), two = _mm_set1_pd(2);
+        for (; lane + 2 <= packet.size; lane += 2)
+        {
+            __m128d Lx = _mm_sub_pd(_mm_loadu_pd(packet.ox + lane), _mm_set1_pd(reference_point.x));
+            __m128d Ly = _mm_sub_pd(_mm_loadu_pd(packet.oy + lane), _mm_set1_pd(reference_point.y));
+            __m128d Lz = _mm_sub_pd(_mm_loadu_pd(packet.oz + lane), _mm_set1_pd(reference_point.z));
+            __m128d dx = _mm_loadu_pd(packet.dx + lane), dy = _mm_loadu_pd(packet.dy + lane), dz = _mm_loadu_pd(packet.dz + lane);
+            __m128d b = _mm_mul_pd(two, lanes_dot(dx, dy, dz, Lx, Ly, Lz));
+            __m128d c = _mm_sub_pd(lanes_dot(Lx, Ly, Lz, Lx, Ly, Lz), _mm_set1_pd(radius * radius));
+            __m128d delta = _mm_sub_pd(_mm_mul_pd(b, b), _mm_mul_pd(_mm_set1_pd(4), c));
+
+            __m128d root = _mm_sqrt_pd(lanes_select(_mm_cmplt_pd(delta, zero), zero, delta));
+            __m128d t1 = _mm_div_pd(_mm_sub_pd(lanes_negate(b), root), two);
+            __m128d t2 = _mm_div_pd(_mm_add_pd(lanes_negate(b), root), two);
+            __m128d t2_front = _mm_cmpge_pd(t2, zero);
+            __m128d nearest = lanes_select(_mm_cmplt_pd(t2, t1), t2, t1);
+            __m128d t = lanes_select(_mm_cmpge_pd(t1, zero), lanes_select(t2_front, nearest, t1), lanes_select(t2_front, t2, miss));
+            _mm_storeu_pd(hits.t + lane, lanes_select(_mm_cmplt_pd(delta, zero), miss, t));
+            hits.u[lane] = hits.u[lane + 1] = hits.v[lane] = hits.v[lane + 1] = 0;
+            hits.primitive[lane] = hits.primitive[lane + 1] = -1;
+        }
+#endif
+        // The last lane of an odd packet, or every lane without SSE2
+        for (; lane < packet.size; lane++)
+        {
+            double Lx = packet.ox[lane] - reference_point.x, Ly = packet.oy[lane] - reference_point.y, Lz = packet.oz[lane] - reference_point.z;
+            double b = 2 * (packet.dx[lane] * Lx + packet.dy[lane] * Ly + packet.dz[lane] * Lz);
+            double c = (Lx * Lx + Ly * Ly + Lz * Lz) - radius * radius;
+            double delta = b * b - 4 * c;
+
+            double root = sqrt(max(delta, 0.0));
+            double t1 = (-b - root) / 2;
+            double t2 = (-b + root) / 2;
+            double t = t1 >= 0 ? (t2 >= 0 ? min(t1, t2) : t1) : (t2 >= 0 ? t2 : -1.0);
+            hits.t[lane] = delta < 0 ? -1.0 : t;
+            hits.u[lane] = hits.v[lane] = 0;
+            hits.primitive[lane] = -1;
+        }
+    }
+};
+
+// Solves a + beta (b - a) + gamma (c - a) = origin + t dir with Cramer's rule, t or -1 on a miss. Kept as the
+// reference for check_triangle_intersection
+double intersect_triangle_cramer(const Vector &a, const Vector &b, const Vector &c, const Ray &ray, double &beta, double &gamma)
+{
+    auto det = [](double m[3][3])
+    {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    };
+
+    double beta_mat[3][3] = {
+        {a.x - ray.origin.x, a.x - c.x, ray.dir.x},
+        {a.y - ray.origin.y, a.y - c.y, ray.dir.y},
+        {a.z - ray.origin.z, a.z - c.z, ray.dir.z}};
+
+    double gamma_mat[3][3] = {
+        {a.x - b.x, a.x - ray.origin.x, ray.dir.x},
+        {a.y - b.y, a.y - ray.origin.y, ray.dir.y},
+        {a.z - b.z, a.z - ray.origin.z, ray.dir.z}};
+
+    double t_mat[3][3] = {
+        {a.x - b.x, a.x - c.x, a.x - ray.origin.x},
+        {a.y - b.y, a.y - c.y, a.y - ray.origin.y},
+        {a.z - b.z, a.z - c.z, a.z - ray.origin.z}};
+
+    double A_mat[3][3] = {
+        {a.x - b.x, a.x - c.x, ray.dir.x},
+        {a.y - b.y, a.y - c.y, ray.dir.y},
+        {a.z - b.z, a.z - c.z, ray.dir.z}};
+
+    double A = det(A_mat);
+    beta = det(beta_mat) / A;
+    gamma = det(gamma_mat) / A;
+    double t = det(t_mat) / A;
+
+    if (beta > 0 && gamma > 0 && beta + gamma < 1 && t > 0)
+        return t;
+    return -1.0;
+}
+
+// Möller–Trumbore on the edges edge1 = b - a and edge2 = c - a, same result as intersect_triangle_cramer up
+// to rounding. The barycentrics and t are compared scaled by the determinant, so misses are rejected
+// before the division
+double intersect_triangle(const Vector &a, const Vector &edge1, const Vector &edge2, const Ray &ray, double &beta, double &gamma)
+{
+    Vector p = ray.dir.cross(edge2);
+    double det = edge1.dot(p);
+    if (det == 0)
         return -1.0;
+    double sign = copysign(1.0, det), abs_det = fabs(det);
+
+    Vector s = ray.origin - a;
+    double beta_scaled = s.dot(p) * sign;
+    Vector q = s.cross(edge1);
+    double gamma_scaled = ray.dir.dot(q) * sign;
+    double t_scaled = edge2.dot(q) * sign;
+    if ((beta_scaled <= 0) | (gamma_scaled <= 0) | (beta_scaled + gamma_scaled >= abs_det) | (t_scaled <= 0))
+        return -1.0;
+
+    double inv_det = 1 / abs_det;
+    beta = beta_scaled * inv_det, gamma = gamma_scaled * inv_det;
+    return t_scaled * inv_det;
+}
+
+// Per ray setup of the watertight test: the ray is sheared onto the +z axis of a permuted frame, kz being its
+// dominant direction
+struct WatertightRay
+{
+    int kx, ky, kz;
+    double shear_x, shear_y, shear_z;
+    Vector origin;
+
+    WatertightRay(const Ray &ray) : origin(ray.origin)
+    {
+        double d[3] = {ray.dir.x, ray.dir.y, ray.dir.z};
+        kz = fabs(d[0]) > fabs(d[1]) ? (fabs(d[0]) > fabs(d[2]) ? 0 : 2) : (fabs(d[1]) > fabs(d[2]) ? 1 : 2);
+        kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+        // Keeps the winding of the triangle
+        if (d[kz] < 0)
+            swap(kx, ky);
+        shear_x = d[kx] / d[kz], shear_y = d[ky] / d[kz], shear_z = 1 / d[kz];
     }
 };
 
+// Watertight ray/triangle test (Woop, Benthin and Wald 2013): points on an edge shared by two triangles hit at
+// least one of them, so rays cannot slip through the seams of a mesh
+double intersect_triangle_watertight(const Vector &a, const Vector &b, const Vector &c, const WatertightRay &ray, double &beta, double &gamma)
+{
+    double A[3] = {a.x - ray.origin.x, a.y - ray.origin.y, a.z - ray.origin.z};
+    double B[3] = {b.x - ray.origin.x, b.y - ray.origin.y, b.z - ray.origin.z};
+    double C[3] = {c.x - ray.origin.x, c.y - ray.origin.y, c.z - ray.origin.z};
+    double Az = ray.shear_z * A[ray.kz], Bz = ray.shear_z * B[ray.kz], Cz = ray.shear_z * C[ray.kz];
+    double Ax = A[ray.kx] - ray.shear_x * A[ray.kz], Ay = A[ray.ky] - ray.shear_y * A[ray.kz];
+    double Bx = B[ray.kx] - ray.shear_x * B[ray.kz], By = B[ray.ky] - ray.shear_y * B[ray.kz];
+    double Cx = C[ray.kx] - ray.shear_x * C[ray.kz], Cy = C[ray.ky] - ray.shear_y * C[ray.kz];
+
+    // Scaled barycentrics of a, b and c
+    double U = Cx * By - Cy * Bx;
+    double V = Ax * Cy - Ay * Cx;
+    double W = Bx * Ay - By * Ax;
+    if (((U < 0) | (V < 0) | (W < 0)) & ((U > 0) | (V > 0) | (W > 0)))
+        return -1.0;
+
+    // t = T / det must be positive, checked before the division
+    double det = U + V + W;
+    double T = U * Az + V * Bz + W * Cz;
+    if (det == 0 || T * copysign(1.0, det) <= 0)
+        return -1.0;
+
+    double inv_det = 1 / det;
+    beta = V * inv_det, gamma = W * inv_det;
+    return T * inv_det;
+}
+
 class Triangle : public Object
 {
 public:
     Vector a, b, c;
+    Vector edge1, edge2, normal;
 
-    Triangle(const Vector &v1, const Vector &v2, const Vector &v3) : a(v1), b(v2), c(v3) {}
+    Triangle(const Vector &v1, const Vector &v2, const Vector &v3) : a(v1), b(v2), c(v3)
+    {
+        edge1 = b - a;
+        edge2 = c - a;
+        normal = edge1.cross(edge2).normalize();
+    }
 
     void draw() const override
     {
@@ -676,46 +1048,86 @@ public:
         glEnd();
     }
 
-    Vector get_normal(const Vector &) const override
+    Vector get_normal(const HitRecord &) const override
     {
-        return (b - a).cross(c - a).normalize();
+        return normal;
     }
 
-    double intersect(Ray ray) const override
+    bool get_bounds(AABB &box) const override
     {
-        auto det = [](double m[3][3])
-        {
-            return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
-        };
-
-        double beta_mat[3][3] = {
-            {a.x - ray.origin.x, a.x - c.x, ray.dir.x},
-            {a.y - ray.origin.y, a.y - c.y, ray.dir.y},
-            {a.z - ray.origin.z, a.z - c.z, ray.dir.z}};
-
-        double gamma_mat[3][3] = {
-            {a.x - b.x, a.x - ray.origin.x, ray.dir.x},
-            {a.y - b.y, a.y - ray.origin.y, ray.dir.y},
-            {a.z - b.z, a.z - ray.origin.z, ray.dir.z}};
-
-        double t_mat[3][3] = {
-            {a.x - b.x, a.x - c.x, a.x - ray.origin.x},
-            {a.y - b.y, a.y - c.y, a.y - ray.origin.y},
-            {a.z - b.z, a.z - c.z, a.z - ray.origin.z}};
-
-        double A_mat[3][3] = {
-            {a.x - b.x, a.x - c.x, ray.dir.x},
-            {a.y - b.y, a.y - c.y, ray.dir.y},
-            {a.z - b.z, a.z - c.z, ray.dir.z}};
+        box = AABB();
+        box.expand(a);
+        box.expand(b);
+        box.expand(c);
+        return true;
+    }
 
-        double A = det(A_mat);
-        double beta = det(beta_mat) / A;
-        double gamma = det(gamma_mat) / A;
-        double t = det(t_mat) / A;
+    // (u, v) are the barycentric weights of b and c
+    double intersect(const Ray &ray, HitRecord &hit) const override
+    {
+        double beta, gamma;
+        double t = intersect_triangle(a, edge1, edge2, ray, beta, gamma);
+        if (t > 0)
+            hit.t = t, hit.u = beta, hit.v = gamma;
+        return t;
+    }
 
-        if (beta > 0 && gamma > 0 && beta + gamma < 1 && t > 0)
-            return t;
-        return -1.0;
+    // intersect_triangle with selects in place of its branches, two lanes at a time with SSE2
+    void intersect_packet(const RayPacket &packet, PacketHits &hits) const override
+    {
+        int lane = 0;
+#ifdef __SSE2__
+        const __m128d zero = _mm_setzero_pd(), sign_bit = _mm_set1_pd(-0.0);
+        const __m128d e1x = _mm_set1_pd(edge1.x), e1y = _mm_set1_pd(edge1.y), e1z = _mm_set1_pd(edge1.z);
+        const __m128d e2x = _mm_set1_pd(edge2.x), e2y = _mm_set1_pd(edge2.y), e2z = _mm_set1_pd(edge2.z);
+        for (; lane + 2 <= packet.size; lane += 2)
+        {
+            __m128d dx = _mm_loadu_pd(packet.dx + lane), dy = _mm_loadu_pd(packet.dy + lane), dz = _mm_loadu_pd(packet.dz + lane);
+            __m128d px = lanes_cross_term(dy, e2z, dz, e2y), py = lanes_cross_term(dz, e2x, dx, e2z), pz = lanes_cross_term(dx, e2y, dy, e2x);
+            __m128d det = lanes_dot(e1x, e1y, e1z, px, py, pz);
+            __m128d sign = _mm_or_pd(_mm_and_pd(det, sign_bit), _mm_set1_pd(1.0)), abs_det = _mm_andnot_pd(sign_bit, det);
+
+            __m128d sx = _mm_sub_pd(_mm_loadu_pd(packet.ox + lane), _mm_set1_pd(a.x));
+            __m128d sy = _mm_sub_pd(_mm_loadu_pd(packet.oy + lane), _mm_set1_pd(a.y));
+            __m128d sz = _mm_sub_pd(_mm_loadu_pd(packet.oz + lane), _mm_set1_pd(a.z));
+            __m128d beta_scaled = _mm_mul_pd(lanes_dot(sx, sy, sz, px, py, pz), sign);
+            __m128d qx = lanes_cross_term(sy, e1z, sz, e1y), qy = lanes_cross_term(sz, e1x, sx, e1z), qz = lanes_cross_term(sx, e1y, sy, e1x);
+            __m128d gamma_scaled = _mm_mul_pd(lanes_dot(dx, dy, dz, qx, qy, qz), sign);
+            __m128d t_scaled = _mm_mul_pd(lanes_dot(e2x, e2y, e2z, qx, qy, qz), sign);
+            __m128d miss = _mm_or_pd(_mm_or_pd(_mm_cmpeq_pd(det, zero), _mm_cmple_pd(beta_scaled, zero)),
+                                     _mm_or_pd(_mm_cmple_pd(gamma_scaled, zero), _mm_cmple_pd(t_scaled, zero)));
+            miss = _mm_or_pd(miss, _mm_cmpge_pd(_mm_add_pd(beta_scaled, gamma_scaled), abs_det));
+
+            __m128d inv_det = _mm_div_pd(_mm_set1_pd(1.0), abs_det);
+            _mm_storeu_pd(hits.t + lane, lanes_select(miss, _mm_set1_pd(-1.0), _mm_mul_pd(t_scaled, inv_det)));
+            _mm_storeu_pd(hits.u + lane, lanes_select(miss, zero, _mm_mul_pd(beta_scaled, inv_det)));
+            _mm_storeu_pd(hits.v + lane, lanes_select(miss, zero, _mm_mul_pd(gamma_scaled, inv_det)));
+            hits.primitive[lane] = hits.primitive[lane + 1] = -1;
+        }
+#endif
+        // The last lane of an odd packet, or every lane without SSE2
+        for (; lane < packet.size; lane++)
+        {
+            double dx = packet.dx[lane], dy = packet.dy[lane], dz = packet.dz[lane];
+            double px = dy * edge2.z - dz * edge2.y, py = dz * edge2.x - dx * edge2.z, pz = dx * edge2.y - dy * edge2.x;
+            double det = edge1.x * px + edge1.y * py + edge1.z * pz;
+            double sign = copysign(1.0, det), abs_det = fabs(det);
+
+            double sx = packet.ox[lane] - a.x, sy = packet.oy[lane] - a.y, sz = packet.oz[lane] - a.z;
+            double beta_scaled = (sx * px + sy * py + sz * pz) * sign;
+            double qx = sy * edge1.z - sz * edge1.y, qy = sz * edge1.x - sx * edge1.z, qz = sx * edge1.y - sy * edge1.x;
+            double gamma_scaled = (dx * qx + dy * qy + dz * qz) * sign;
+            double t_scaled = (edge2.x * qx + edge2.y * qy + edge2.z * qz) * sign;
+            bool miss = (det == 0) | (beta_scaled <= 0) | (gamma_scaled <= 0) | (beta_scaled + gamma_scaled >= abs_det) | (t_scaled <= 0);
+
+            // Computed on every lane so that the selects need no branches
+            double inv_det = 1 / abs_det;
+            double t = t_scaled * inv_det, beta = beta_scaled * inv_det, gamma = gamma_scaled * inv_det;
+            hits.t[lane] = miss ? -1.0 : t;
+            hits.u[lane] = miss ? 0 : beta;
+            hits.v[lane] = miss ? 0 : gamma;
+            hits.primitive[lane] = -1;
+        }
     }
 };
 
@@ -733,8 +1145,9 @@ public:
 
     void draw() const override {}
 
-    Vector get_normal(const Vector &p) const override
+    Vector get_normal(const HitRecord &hit) const override
     {
+        const Vector &p = hit.point;
         return Vector(
                    2 * A * p.x + D * p.y + F * p.z + G,
                    2 * B * p.y + D * p.x + E * p.z + H,
@@ -742,7 +1155,57 @@ public:
             .normalize();
     }
 
-    double intersect(Ray ray) const override
+    // The clipping box limits the dimensions it clips. An ellipsoid (definite quadratic part) is bounded in
+    // every dimension by the box around its center with half extents sqrt(r * Q^-1_ii), where Q is the
+    // symmetric matrix of the quadratic part and r the value the quadratic form takes on the surface.
+    bool get_bounds(AABB &box) const override
+    {
+        const double inf = numeric_limits<double>::infinity();
+        double lo[3] = {-inf, -inf, -inf}, hi[3] = {inf, inf, inf};
+        double ref[3] = {reference_point.x, reference_point.y, reference_point.z}, dims[3] = {length, width, height};
+        for (int i = 0; i < 3; i++)
+            if (dims[i])
+                lo[i] = ref[i] - EPS, hi[i] = ref[i] + dims[i] + EPS;
+
+        double sign = A < 0 ? -1 : 1;
+        double q[3][3] = {{sign * A, sign * D / 2, sign * F / 2}, {sign * D / 2, sign * B, sign * E / 2}, {sign * F / 2, sign * E / 2, sign * C}};
+        double g[3] = {sign * G, sign * H, sign * I};
+        double minor2 = q[0][0] * q[1][1] - q[0][1] * q[1][0];
+        double det = q[0][0] * (q[1][1] * q[2][2] - q[1][2] * q[2][1]) - q[0][1] * (q[1][0] * q[2][2] - q[1][2] * q[2][0]) +
+                     q[0][2] * (q[1][0] * q[2][1] - q[1][1] * q[2][0]);
+        if (q[0][0] > EPS && minor2 > EPS && det > EPS)
+        {
+            double inv[3][3];
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                {
+                    int i1 = (j + 1) % 3, i2 = (j + 2) % 3, j1 = (i + 1) % 3, j2 = (i + 2) % 3;
+                    inv[i][j] = (q[i1][j1] * q[i2][j2] - q[i1][j2] * q[i2][j1]) / det;
+                }
+
+            double center[3], r = -sign * J;
+            for (int i = 0; i < 3; i++)
+                center[i] = -(inv[i][0] * g[0] + inv[i][1] * g[1] + inv[i][2] * g[2]) / 2;
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    r += center[i] * q[i][j] * center[j];
+            r = max(r, 0.0);
+
+            for (int i = 0; i < 3; i++)
+            {
+                double extent = sqrt(r * inv[i][i]) * (1 + EPS) + EPS;
+                lo[i] = max(lo[i], center[i] - extent), hi[i] = min(hi[i], center[i] + extent);
+            }
+        }
+
+        for (int i = 0; i < 3; i++)
+            if (isinf(lo[i]) || isinf(hi[i]))
+                return false;
+        box = AABB(Vector(lo[0], lo[1], lo[2]), Vector(hi[0], hi[1], hi[2]));
+        return true;
+    }
+
+    double intersect(const Ray &ray, HitRecord &hit) const override
     {
         double dx = ray.dir.x, dy = ray.dir.y, dz = ray.dir.z;
         double x0 = ray.origin.x, y0 = ray.origin.y, z0 = ray.origin.z;
@@ -776,9 +1239,1115 @@ public:
         };
 
         if (t1 > 0 && inside_bounds(t1))
-            return t1;
+            return hit.t = t1;
         if (t2 > 0 && inside_bounds(t2))
-            return t2;
+            return hit.t = t2;
         return -1.0;
     }
+
+    // Same arithmetic as intersect with selects in place of branches, two lanes at a time with SSE2
+    void intersect_packet(const RayPacket &packet, PacketHits &hits) const override
+    {
+        int lane = 0;
+#ifdef __SSE2__
+        auto add = [](__m128d x, __m128d y)
+        { return _mm_add_pd(x, y); };
+        auto mul = [](__m128d x, __m128d y)
+        { return _mm_mul_pd(x, y); };
+        const __m128d zero = _mm_setzero_pd(), miss = _mm_set1_pd(-1.0), two = _mm_set1_pd(2);
+        const __m128d a_ = _mm_set1_pd(A), b_ = _mm_set1_pd(B), c_ = _mm_set1_pd(C), d_ = _mm_set1_pd(D), e_ = _mm_set1_pd(E);
+        const __m128d f_ = _mm_set1_pd(F), g_ = _mm_set1_pd(G), h_ = _mm_set1_pd(H), i_ = _mm_set1_pd(I), j_ = _mm_set1_pd(J);
+
+        // Lanes whose point at t lies within the clipped dimensions, a size of 0 leaves its dimension unclipped
+        auto inside_bounds = [&](__m128d x0, __m128d y0, __m128d z0, __m128d dx, __m128d dy, __m128d dz, __m128d t)
+        {
+            __m128d inside = _mm_cmpeq_pd(zero, zero);
+            auto clip = [&](__m128d origin, __m128d dir, double lo, double size)
+            {
+                if (size == 0)
+                    return;
+                __m128d p = add(origin, mul(dir, t));
+                inside = _mm_and_pd(inside, _mm_and_pd(_mm_cmpge_pd(p, _mm_set1_pd(lo - EPS)), _mm_cmple_pd(p, _mm_set1_pd(lo + size + EPS))));
+            };
+            clip(x0, dx, reference_point.x, length);
+            clip(y0, dy, reference_point.y, width);
+            clip(z0, dz, reference_point.z, height);
+            return inside;
+        };
+
+        for (; lane + 2 <= packet.size; lane += 2)
+        {
+            __m128d dx = _mm_loadu_pd(packet.dx + lane), dy = _mm_loadu_pd(packet.dy + lane), dz = _mm_loadu_pd(packet.dz + lane);
+            __m128d x0 = _mm_loadu_pd(packet.ox + lane), y0 = _mm_loadu_pd(packet.oy + lane), z0 = _mm_loadu_pd(packet.oz + lane);
+
+            __m128d a = add(add(add(add(add(mul(mul(a_, dx), dx), mul(mul(b_, dy), dy)), mul(mul(c_, dz), dz)),
+                                    mul(mul(d_, dx), dy)),
+                                mul(mul(e_, dy), dz)),
+                            mul(mul(f_, dz), dx));
+
+            __m128d b = mul(two, add(add(mul(mul(a_, x0), dx), mul(mul(b_, y0), dy)), mul(mul(c_, z0), dz)));
+            b = add(b, mul(d_, add(mul(x0, dy), mul(y0, dx))));
+            b = add(b, mul(e_, add(mul(y0, dz), mul(z0, dy))));
+            b = add(b, mul(f_, add(mul(z0, dx), mul(x0, dz))));
+            b = add(add(add(b, mul(g_, dx)), mul(h_, dy)), mul(i_, dz));
+
+            __m128d c = add(add(mul(mul(a_, x0), x0), mul(mul(b_, y0), y0)), mul(mul(c_, z0), z0));
+            c = add(add(add(c, mul(mul(d_, x0), y0)), mul(mul(e_, y0), z0)), mul(mul(f_, z0), x0));
+            c = add(add(add(add(c, mul(g_, x0)), mul(h_, y0)), mul(i_, z0)), j_);
+
+            __m128d disc = _mm_sub_pd(mul(b, b), mul(mul(_mm_set1_pd(4), a), c));
+            __m128d root = _mm_sqrt_pd(lanes_select(_mm_cmplt_pd(disc, zero), zero, disc));
+            __m128d t1 = _mm_div_pd(_mm_sub_pd(lanes_negate(b), root), mul(two, a));
+            __m128d t2 = _mm_div_pd(add(lanes_negate(b), root), mul(two, a));
+
+            __m128d first = _mm_and_pd(_mm_cmpgt_pd(t1, zero), inside_bounds(x0, y0, z0, dx, dy, dz, t1));
+            __m128d second = _mm_and_pd(_mm_cmpgt_pd(t2, zero), inside_bounds(x0, y0, z0, dx, dy, dz, t2));
+            __m128d t = lanes_select(first, t1, lanes_select(second, t2, miss));
+            _mm_storeu_pd(hits.t + lane, lanes_select(_mm_cmplt_pd(disc, zero), miss, t));
+            hits.u[lane] = hits.u[lane + 1] = hits.v[lane] = hits.v[lane + 1] = 0;
+            hits.primitive[lane] = hits.primitive[lane + 1] = -1;
+        }
+#endif
+        // The last lane of an odd packet, or every lane without SSE2
+        for (; lane < packet.size; lane++)
+        {
+            double dx = packet.dx[lane], dy = packet.dy[lane], dz = packet.dz[lane];
+            double x0 = packet.ox[lane], y0 = packet.oy[lane], z0 = packet.oz[lane];
+
+            double a = A * dx * dx + B * dy * dy + C * dz * dz +
+                       D * dx * dy + E * dy * dz + F * dz * dx;
+
+            double b = 2 * (A * x0 * dx + B * y0 * dy + C * z0 * dz) +
+                       D * (x0 * dy + y0 * dx) +
+                       E * (y0 * dz + z0 * dy) +
+                       F * (z0 * dx + x0 * dz) +
+                       G * dx + H * dy + I * dz;
+
+            double c = A * x0 * x0 + B * y0 * y0 + C * z0 * z0 +
+                       D * x0 * y0 + E * y0 * z0 + F * z0 * x0 +
+                       G * x0 + H * y0 + I * z0 + J;
+
+            double disc = b * b - 4 * a * c;
+            double root = sqrt(max(disc, 0.0));
+            double t1 = (-b - root) / (2 * a);
+            double t2 = (-b + root) / (2 * a);
+
+            auto inside_bounds = [&](double t)
+            {
+                double px = x0 + dx * t, py = y0 + dy * t, pz = z0 + dz * t;
+                return ((length == 0) | ((px >= reference_point.x - EPS) & (px <= reference_point.x + length + EPS))) &
+                       ((width == 0) | ((py >= reference_point.y - EPS) & (py <= reference_point.y + width + EPS))) &
+                       ((height == 0) | ((pz >= reference_point.z - EPS) & (pz <= reference_point.z + height + EPS)));
+            };
+
+            bool first = (t1 > 0) & inside_bounds(t1), second = (t2 > 0) & inside_bounds(t2);
+            hits.t[lane] = disc < 0 ? -1.0 : first ? t1 : second ? t2 : -1.0;
+            hits.u[lane] = hits.v[lane] = 0;
+            hits.primitive[lane] = -1;
+        }
+    }
 };
+
+// Bounding volume hierarchy over numbered items, split with the surface area heuristic over binned
+// centroids. Items with an infinite box are tested on every query. The queries call back into the owner for
+// the item tests, so the scene and every mesh share this code.
+class BVH
+{
+    struct Node
+    {
+        AABB box;
+        // Children of an inner node, or items [first, first + count) of a leaf
+        int left, right, first, count;
+    };
+
+    static const int BINS = 16;
+    static const int MAX_LEAF_SIZE = 4;
+    // Deeper nodes become leaves, keeps the traversal stack bounded
+    static const int MAX_DEPTH = 60;
+    // A traversal pops a node before pushing its children, so the stack holds at most one pending sibling for
+    // each level down to the deepest inner node, plus that node's two children
+    static const int STACK_SIZE = MAX_DEPTH + 1;
+    // Cost of visiting a node relative to one item intersection
+    static constexpr double TRAVERSAL_COST = 0.5;
+
+    vector<Node> nodes;
+    vector<int> items, unbounded;
+    const vector<AABB> *boxes = nullptr;
+
+    int build_node(int first, int count, int depth)
+    {
+        AABB box, centroids;
+        for (int i = first; i < first + count; i++)
+        {
+            box.expand((*boxes)[items[i]]);
+            centroids.expand((*boxes)[items[i]].center());
+        }
+
+        int index = nodes.size();
+        nodes.push_back(Node{box, -1, -1, first, count});
+        if (count <= 1 || depth >= MAX_DEPTH)
+            return index;
+
+        Vector extent = centroids.hi - centroids.lo;
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+        double axis_lo = axis == 0 ? centroids.lo.x : axis == 1 ? centroids.lo.y : centroids.lo.z;
+        double axis_extent = axis == 0 ? extent.x : axis == 1 ? extent.y : extent.z;
+        if (axis_extent <= EPS)
+        {
+            if (count <= MAX_LEAF_SIZE)
+                return index;
+            return split_node(index, first, count, first + count / 2, depth);
+        }
+
+        auto coordinate = [&](int item)
+        {
+            Vector c = (*boxes)[item].center();
+            return axis == 0 ? c.x : axis == 1 ? c.y : c.z;
+        };
+        auto bin_of = [&](int item)
+        { return min(BINS - 1, (int)((coordinate(item) - axis_lo) / axis_extent * BINS)); };
+
+        int bin_count[BINS] = {};
+        AABB bin_box[BINS];
+        for (int i = first; i < first + count; i++)
+        {
+            int bin = bin_of(items[i]);
+            bin_count[bin]++;
+            bin_box[bin].expand((*boxes)[items[i]]);
+        }
+
+        // Sweep from the right for the cost of every right side, then from the left
+        double right_area[BINS];
+        int right_count[BINS];
+        AABB right_box;
+        for (int b = BINS - 1, n = 0; b > 0; b--)
+        {
+            right_box.expand(bin_box[b]);
+            n += bin_count[b];
+            right_area[b] = right_box.surface_area(), right_count[b] = n;
+        }
+
+        double best_cost = 1e300;
+        int best_split = -1;
+        AABB left_box;
+        for (int b = 0, n = 0; b < BINS - 1; b++)
+        {
+            left_box.expand(bin_box[b]);
+            n += bin_count[b];
+            if (n == 0 || right_count[b + 1] == 0)
+                continue;
+            double cost = left_box.surface_area() * n + right_area[b + 1] * right_count[b + 1];
+            if (cost < best_cost)
+                best_cost = cost, best_split = b;
+        }
+
+        double area = max(box.surface_area(), EPS);
+        double leaf_cost = count;
+        double split_cost = TRAVERSAL_COST + best_cost / area;
+        if (best_split < 0 || (count <= MAX_LEAF_SIZE && leaf_cost <= split_cost))
+        {
+            if (count <= MAX_LEAF_SIZE)
+                return index;
+            return split_node(index, first, count, first + count / 2, depth);
+        }
+
+        int middle = partition(items.begin() + first, items.begin() + first + count,
+                               [&](int item) { return bin_of(item) <= best_split; }) -
+                     items.begin();
+        return split_node(index, first, count, middle, depth);
+    }
+
+    int split_node(int index, int first, int count, int middle, int depth)
+    {
+        int left = build_node(first, middle - first, depth + 1);
+        int right = build_node(middle, first + count - middle, depth + 1);
+        nodes[index].left = left, nodes[index].right = right, nodes[index].count = 0;
+        return index;
+    }
+
+    // Keeps the nearer hit, or the lower numbered item at equal distance
+    template <class Intersect>
+    static void test(int item, double t_min, double t_max, Intersect &intersect, int &best, HitRecord &hit)
+    {
+        HitRecord candidate;
+        double t = intersect(item, candidate);
+        if (t > t_min && t < t_max && (best == -1 || t < hit.t || (t == hit.t && item < best)))
+            best = item, hit = candidate;
+    }
+
+public:
+    // item_boxes[i] bounds item i
+    void build(const vector<AABB> &item_boxes)
+    {
+        nodes.clear(), items.clear(), unbounded.clear();
+        for (int i = 0; i < (int)item_boxes.size(); i++)
+        {
+            const AABB &box = item_boxes[i];
+            if (isinf(box.lo.x) || isinf(box.lo.y) || isinf(box.lo.z) || isinf(box.hi.x) || isinf(box.hi.y) || isinf(box.hi.z))
+                unbounded.push_back(i);
+            else
+                items.push_back(i);
+        }
+
+        boxes = &item_boxes;
+        if (!items.empty())
+            build_node(0, items.size(), 0);
+        boxes = nullptr;
+    }
+
+    // Nearest item with t_min < t < t_max, -1 when there is none. intersect(item, candidate) returns the
+    // distance to item like Object::intersect and fills the candidate record, hit receives the winner's.
+    template <class Intersect>
+    int closest(const Ray &ray, double t_min, double t_max, Intersect intersect, HitRecord &hit) const
+    {
+        int best = -1;
+        for (int item : unbounded)
+            test(item, t_min, t_max, intersect, best, hit);
+
+        if (!nodes.empty())
+        {
+            Vector inv_dir(1 / ray.dir.x, 1 / ray.dir.y, 1 / ray.dir.z);
+            int stack[STACK_SIZE], top = 0;
+            stack[top++] = 0;
+            while (top)
+            {
+                const Node &node = nodes[stack[--top]];
+                double best_t = best == -1 ? t_max : hit.t, t_near;
+                // Boxes entered exactly at best_t can still hold a lower numbered item
+                if (!node.box.intersect(ray, inv_dir, t_min, best_t, t_near))
+                    continue;
+                if (node.count)
+                {
+                    for (int i = node.first; i < node.first + node.count; i++)
+                        test(items[i], t_min, t_max, intersect, best, hit);
+                    continue;
+                }
+
+                // Nearer child on top of the stack
+                double t_left, t_right;
+                bool hit_left = nodes[node.left].box.intersect(ray, inv_dir, t_min, best_t, t_left);
+                bool hit_right = nodes[node.right].box.intersect(ray, inv_dir, t_min, best_t, t_right);
+                if (hit_left && hit_right)
+                {
+                    stack[top++] = t_left <= t_right ? node.right : node.left;
+                    stack[top++] = t_left <= t_right ? node.left : node.right;
+                }
+                else if (hit_left)
+                    stack[top++] = node.left;
+                else if (hit_right)
+                    stack[top++] = node.right;
+            }
+        }
+
+        return best;
+    }
+
+    // The packet form of test, for every lane
+    static void test_packet(int item, int size, const PacketHits &candidates, double t_min, double t_max, int *best, HitRecord *hits)
+    {
+        for (int lane = 0; lane < size; lane++)
+        {
+            double t = candidates.t[lane];
+            if (t > t_min && t < t_max && (best[lane] == -1 || t < hits[lane].t || (t == hits[lane].t && item < best[lane])))
+            {
+                best[lane] = item;
+                hits[lane].t = t, hits[lane].u = candidates.u[lane], hits[lane].v = candidates.v[lane];
+                hits[lane].primitive = candidates.primitive[lane];
+            }
+        }
+    }
+
+    // closest for every lane of a packet with one traversal: a node is visited when any lane enters its box
+    // before that lane's nearest hit so far, and intersect(item, candidates) fills the results of all lanes.
+    // best[lane] and hits[lane] receive what closest would return for the lane's ray
+    template <class IntersectPacket>
+    void closest_packet(const RayPacket &packet, double t_min, double t_max, IntersectPacket intersect, int *best, HitRecord *hits) const
+    {
+        int size = packet.size;
+        for (int lane = 0; lane < size; lane++)
+            best[lane] = -1;
+
+        PacketHits candidates;
+        for (int item : unbounded)
+        {
+            intersect(item, candidates);
+            test_packet(item, size, candidates, t_min, t_max, best, hits);
+        }
+        if (nodes.empty())
+            return;
+
+        double ix[RayPacket::MAX_SIZE], iy[RayPacket::MAX_SIZE], iz[RayPacket::MAX_SIZE];
+        for (int lane = 0; lane < size; lane++)
+            ix[lane] = 1 / packet.dx[lane], iy[lane] = 1 / packet.dy[lane], iz[lane] = 1 / packet.dz[lane];
+
+        // Entry distance of the first lane that enters the box, or -1 when none does
+        auto enter = [&](const AABB &box)
+        {
+            for (int lane = 0; lane < size; lane++)
+            {
+                double limit = best[lane] == -1 ? t_max : hits[lane].t;
+                double tx0 = (box.lo.x - packet.ox[lane]) * ix[lane], tx1 = (box.hi.x - packet.ox[lane]) * ix[lane];
+                double ty0 = (box.lo.y - packet.oy[lane]) * iy[lane], ty1 = (box.hi.y - packet.oy[lane]) * iy[lane];
+                double tz0 = (box.lo.z - packet.oz[lane]) * iz[lane], tz1 = (box.hi.z - packet.oz[lane]) * iz[lane];
+                double near = max(max(t_min, min(tx0, tx1)), max(min(ty0, ty1), min(tz0, tz1)));
+                double far = min(min(limit, max(tx0, tx1)), min(max(ty0, ty1), max(tz0, tz1)));
+                if (near <= far)
+                    return near;
+            }
+            return -1.0;
+        };
+
+        int stack[STACK_SIZE], top = 0;
+        stack[top++] = 0;
+        while (top)
+        {
+            const Node &node = nodes[stack[--top]];
+            if (enter(node.box) < 0)
+                continue;
+            if (node.count)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    intersect(items[i], candidates);
+                    test_packet(items[i], size, candidates, t_min, t_max, best, hits);
+                }
+                continue;
+            }
+
+            // Nearer child, for the first lane entering each, on top of the stack
+            double t_left = enter(nodes[node.left].box), t_right = enter(nodes[node.right].box);
+            if (t_left >= 0 && t_right >= 0)
+            {
+                stack[top++] = t_left <= t_right ? node.right : node.left;
+                stack[top++] = t_left <= t_right ? node.left : node.right;
+            }
+            else if (t_left >= 0)
+                stack[top++] = node.left;
+            else if (t_right >= 0)
+                stack[top++] = node.right;
+        }
+    }
+
+    // Whether occluded(item) holds for any item whose box the ray crosses within (t_min, t_max). Children
+    // are visited in any order since the first hit ends the query
+    template <class Occluded>
+    bool any(const Ray &ray, double t_min, double t_max, Occluded occluded) const
+    {
+        for (int item : unbounded)
+            if (occluded(item))
+                return true;
+        if (nodes.empty())
+            return false;
+
+        Vector inv_dir(1 / ray.dir.x, 1 / ray.dir.y, 1 / ray.dir.z);
+        int stack[STACK_SIZE], top = 0;
+        stack[top++] = 0;
+        while (top)
+        {
+            const Node &node = nodes[stack[--top]];
+            double t_near;
+            if (!node.box.intersect(ray, inv_dir, t_min, t_max, t_near))
+                continue;
+            if (node.count)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                    if (occluded(items[i]))
+                        return true;
+                continue;
+            }
+            stack[top++] = node.right;
+            stack[top++] = node.left;
+        }
+        return false;
+    }
+};
+
+// Reads "v" and "f" lines, faces with more than three corners are split into a fan. Indices may be negative
+// (relative to the end) and carry /texture/normal parts, which are ignored. Fails on a malformed line
+bool load_obj(const string &filename, vector<Vector> &vertices, vector<array<int, 3>> &faces)
+{
+    ifstream file(filename);
+    if (!file.is_open())
+        return false;
+
+    string line;
+    while (getline(file, line))
+    {
+        istringstream in(line);
+        string tag;
+        in >> tag;
+        if (tag == "v")
+        {
+            double x, y, z;
+            if (!(in >> x >> y >> z))
+                return false;
+            vertices.push_back(Vector(x, y, z));
+        }
+        else if (tag == "f")
+        {
+            vector<int> corners;
+            string corner;
+            while (in >> corner)
+            {
+                char *end;
+                errno = 0;
+                long index = strtol(corner.c_str(), &end, 10);
+                if (end == corner.c_str() || (*end && *end != '/') || errno == ERANGE || index < INT_MIN || index > INT_MAX)
+                    return false;
+                corners.push_back(index < 0 ? (int)vertices.size() + index : index - 1);
+            }
+            for (int i = 1; i + 1 < (int)corners.size(); i++)
+                faces.push_back({corners[0], corners[i], corners[i + 1]});
+        }
+    }
+    return true;
+}
+
+// Reads the x, y, z properties of the "vertex" element and the index list of the "face" element, other
+// elements and properties are skipped. Handles ascii and both binary byte orders. Fails on a short read or a
+// list longer than MAX_LIST_SIZE
+bool load_ply(const string &filename, vector<Vector> &vertices, vector<array<int, 3>> &faces)
+{
+    ifstream file(filename, ios::binary);
+    if (!file.is_open())
+        return false;
+
+    struct Property
+    {
+        string name, type, count_type;
+        bool list;
+    };
+    struct Element
+    {
+        string name;
+        long long count;
+        vector<Property> properties;
+    };
+
+    string line, format;
+    vector<Element> elements;
+    getline(file, line);
+    if (line.compare(0, 3, "ply"))
+        return false;
+    while (getline(file, line))
+    {
+        istringstream in(line);
+        string keyword;
+        in >> keyword;
+        if (keyword == "format")
+            in >> format;
+        else if (keyword == "element")
+        {
+            elements.push_back(Element());
+            in >> elements.back().name >> elements.back().count;
+        }
+        else if (keyword == "property" && !elements.empty())
+        {
+            Property property;
+            in >> property.type;
+            property.list = property.type == "list";
+            if (property.list)
+                in >> property.count_type >> property.type;
+            in >> property.name;
+            elements.back().properties.push_back(property);
+        }
+        else if (keyword == "end_header")
+            break;
+    }
+
+    bool ascii = format == "ascii";
+    bool swap_bytes = format == "binary_big_endian";
+    if (!ascii && !swap_bytes && format != "binary_little_endian")
+        return false;
+    const int MAX_LIST_SIZE = 1 << 16;
+
+    auto read_value = [&](const string &type)
+    {
+        if (ascii)
+        {
+            double value = 0;
+            file >> value;
+            return value;
+        }
+
+        int size = type == "char" || type == "uchar" || type == "int8" || type == "uint8"       ? 1
+                   : type == "short" || type == "ushort" || type == "int16" || type == "uint16" ? 2
+                   : type == "double" || type == "float64"                                        ? 8
+                                                                                                  : 4;
+        // Zeroed so that a short read, which the caller detects through file, gives no stack garbage
+        unsigned char bytes[8] = {};
+        file.read((char *)bytes, size);
+        if (swap_bytes)
+            reverse(bytes, bytes + size);
+
+        auto as = [&](auto value)
+        {
+            memcpy(&value, bytes, sizeof(value));
+            return (double)value;
+        };
+        if (type == "char" || type == "int8")
+            return as(int8_t());
+        if (type == "uchar" || type == "uint8")
+            return as(uint8_t());
+        if (type == "short" || type == "int16")
+            return as(int16_t());
+        if (type == "ushort" || type == "uint16")
+            return as(uint16_t());
+        if (type == "int" || type == "int32")
+            return as(int32_t());
+        if (type == "uint" || type == "uint32")
+            return as(uint32_t());
+        if (type == "float" || type == "float32")
+            return as(float());
+        return as(double());
+    };
+
+    for (const Element &element : elements)
+        for (long long n = 0; n < element.count && file; n++)
+        {
+            double position[3] = {0, 0, 0};
+            for (const Property &property : element.properties)
+            {
+                if (!property.list)
+                {
+                    double value = read_value(property.type);
+                    if (!file)
+                        return false;
+                    if (property.name == "x" || property.name == "y" || property.name == "z")
+                        position[property.name[0] - 'x'] = value;
+                    continue;
+                }
+
+                double size = read_value(property.count_type);
+                if (!file || !(size >= 0 && size <= MAX_LIST_SIZE))
+                    return false;
+                int count = size;
+                vector<int> corners(count);
+                // Indices beyond int become -1, a face load_mesh drops
+                for (int i = 0; i < count; i++)
+                {
+                    double index = read_value(property.type);
+                    corners[i] = index >= 0 && index <= INT_MAX ? (int)index : -1;
+                }
+                if (!file)
+                    return false;
+                if (element.name == "face" && (property.name == "vertex_indices" || property.name == "vertex_index"))
+                    for (int i = 1; i + 1 < count; i++)
+                        faces.push_back({corners[0], corners[i], corners[i + 1]});
+            }
+            if (element.name == "vertex")
+                vertices.push_back(Vector(position[0], position[1], position[2]));
+        }
+    return (bool)file;
+}
+
+// Loads an .obj or .ply file, faces pointing outside the vertex list are dropped
+bool load_mesh(const string &filename, vector<Vector> &vertices, vector<array<int, 3>> &faces)
+{
+    string extension = filename.substr(filename.find_last_of('.') + 1);
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    bool loaded;
+    if (extension == "obj")
+        loaded = load_obj(filename, vertices, faces);
+    else if (extension == "ply")
+        loaded = load_ply(filename, vertices, faces);
+    else
+    {
+        cerr << "Unsupported mesh format: " << filename << endl;
+        return false;
+    }
+    if (!loaded)
+    {
+        cerr << "Failed to load mesh: " << filename << endl;
+        return false;
+    }
+
+    int num_vertices = vertices.size();
+    faces.erase(remove_if(faces.begin(), faces.end(), [&](const array<int, 3> &face)
+                          { return face[0] < 0 || face[1] < 0 || face[2] < 0 ||
+                                   face[0] >= num_vertices || face[1] >= num_vertices || face[2] >= num_vertices; }),
+                faces.end());
+    return true;
+}
+
+// Triangles sharing vertex buffers and one material, hit through a BVH over the faces with the watertight test
+class Mesh : public Object
+{
+public:
+    vector<Vector> vertices;
+    vector<array<int, 3>> faces;
+    vector<Vector> normals;
+    BVH bvh;
+    AABB box;
+
+    Mesh(const vector<Vector> &vertex_list, const vector<array<int, 3>> &face_list) : vertices(vertex_list)
+    {
+        vector<AABB> face_boxes;
+        for (const array<int, 3> &face : face_list)
+        {
+            Vector a = vertices[face[0]], b = vertices[face[1]], c = vertices[face[2]];
+            Vector n = (b - a).cross(c - a);
+            // Degenerate faces can never be hit
+            if (n.norm() <= EPS * EPS)
+                continue;
+
+            faces.push_back(face);
+            normals.push_back(n.normalize());
+            face_boxes.push_back(AABB());
+            face_boxes.back().expand(a);
+            face_boxes.back().expand(b);
+            face_boxes.back().expand(c);
+            box.expand(face_boxes.back());
+        }
+        bvh.build(face_boxes);
+    }
+
+    void draw() const override
+    {
+        glColor3f(color.r, color.g, color.b);
+        glBegin(GL_TRIANGLES);
+        for (const array<int, 3> &face : faces)
+            for (int k : face)
+                glVertex3f(vertices[k].x, vertices[k].y, vertices[k].z);
+        glEnd();
+    }
+
+    Vector get_normal(const HitRecord &hit) const override
+    {
+        return normals[hit.primitive];
+    }
+
+    bool get_bounds(AABB &bounds) const override
+    {
+        bounds = box;
+        return !faces.empty();
+    }
+
+    // (u, v) are the barycentric weights of the face's second and third corners
+    double intersect(const Ray &ray, HitRecord &hit) const override
+    {
+        WatertightRay sheared(ray);
+        auto intersect_face = [&](int f, HitRecord &candidate)
+        {
+            const array<int, 3> &face = faces[f];
+            double beta, gamma;
+            double t = intersect_triangle_watertight(vertices[face[0]], vertices[face[1]], vertices[face[2]], sheared, beta, gamma);
+            candidate.t = t, candidate.u = beta, candidate.v = gamma, candidate.primitive = f;
+            return t;
+        };
+        if (bvh.closest(ray, 0, 1e18, intersect_face, hit) == -1)
+            return -1.0;
+        return hit.t;
+    }
+
+    bool occluded(const Ray &ray, double t_min, double t_max) const override
+    {
+        WatertightRay sheared(ray);
+        return bvh.any(ray, t_min, t_max, [&](int f)
+                       {
+                           const array<int, 3> &face = faces[f];
+                           double beta, gamma;
+                           double t = intersect_triangle_watertight(vertices[face[0]], vertices[face[1]], vertices[face[2]], sheared, beta, gamma);
+                           return t > t_min && t < t_max; });
+    }
+};
+
+// Compares the triangle tests on random triangles and rays: hit/miss agreement with the Cramer's rule reference
+// away from the edges, rays leaking through the shared edge of a quad, and the time per test. Returns the
+// number of failures
+int check_triangle_intersection(int num_triangles = 2000, int rays_per_triangle = 200)
+{
+    mt19937_64 rng(410);
+    uniform_real_distribution<double> coordinate(-100, 100), weight(-0.25, 1.25);
+    auto random_point = [&]()
+    { return Vector(coordinate(rng), coordinate(rng), coordinate(rng)); };
+
+    struct Case
+    {
+        Vector a, b, c, edge1, edge2;
+    };
+    vector<Case> cases;
+    vector<Ray> rays;
+    for (int i = 0; i < num_triangles; i++)
+    {
+        Vector a = random_point(), b = random_point(), c = random_point();
+        if ((b - a).cross(c - a).norm() <= EPS)
+            continue;
+        cases.push_back(Case{a, b, c, b - a, c - a});
+        // Aimed around the triangle so that about half of the rays hit
+        for (int j = 0; j < rays_per_triangle; j++)
+        {
+            double u = weight(rng), v = weight(rng);
+            Vector target = a + (b - a) * u + (c - a) * v, origin = random_point();
+            if ((target - origin).norm() > EPS)
+                rays.push_back(Ray(origin, target - origin));
+        }
+    }
+
+    // Hit/miss is only compared where every barycentric is at least MARGIN away from 0
+    const double MARGIN = 1e-7;
+    long long tests = 0, compared = 0, hits = 0, disagreements = 0;
+    size_t ray_index = 0;
+    for (const Case &triangle : cases)
+        for (int j = 0; j < rays_per_triangle && ray_index < rays.size(); j++, ray_index++)
+        {
+            const Ray &ray = rays[ray_index];
+            double beta, gamma, beta_mt, gamma_mt, beta_wt, gamma_wt;
+            double t = intersect_triangle_cramer(triangle.a, triangle.b, triangle.c, ray, beta, gamma);
+            double t_mt = intersect_triangle(triangle.a, triangle.edge1, triangle.edge2, ray, beta_mt, gamma_mt);
+            double t_wt = intersect_triangle_watertight(triangle.a, triangle.b, triangle.c, WatertightRay(ray), beta_wt, gamma_wt);
+            tests++;
+            if (fabs(beta) < MARGIN || fabs(gamma) < MARGIN || fabs(1 - beta - gamma) < MARGIN)
+                continue;
+            compared++;
+            hits += t > 0;
+            if ((t > 0) != (t_mt > 0) || (t > 0) != (t_wt > 0) ||
+                (t > 0 && (fabs(t - t_mt) > 1e-6 * max(1.0, t) || fabs(t - t_wt) > 1e-6 * max(1.0, t))))
+                disagreements++;
+        }
+
+    // Rays through the diagonal shared by the two halves of a planar quad must hit at least one half
+    long long seam_rays = 0, leaks_mt = 0, leaks_wt = 0;
+    uniform_real_distribution<double> unit(0, 1);
+    for (int i = 0; i < 20000; i++)
+    {
+        Vector p = random_point(), r = random_point(), side = random_point();
+        Vector across = (r - p).cross(side).cross(r - p);
+        if (across.norm() <= EPS)
+            continue;
+        Vector q = p + (r - p) * unit(rng) + across * (unit(rng) / across.norm() * 50);
+        Vector s = p + (r - p) * unit(rng) - across * (unit(rng) / across.norm() * 50);
+        if ((q - p).cross(r - p).norm() <= EPS || (r - p).cross(s - p).norm() <= EPS)
+            continue;
+        double along = unit(rng);
+        Vector target = p + (r - p) * along, origin = random_point();
+        if ((target - origin).norm() <= EPS)
+            continue;
+        Ray ray(origin, target - origin);
+        WatertightRay sheared(ray);
+        double beta, gamma;
+        seam_rays++;
+        if (intersect_triangle(p, q - p, r - p, ray, beta, gamma) < 0 && intersect_triangle(p, r - p, s - p, ray, beta, gamma) < 0)
+            leaks_mt++;
+        if (intersect_triangle_watertight(p, q, r, sheared, beta, gamma) < 0 && intersect_triangle_watertight(p, r, s, sheared, beta, gamma) < 0)
+            leaks_wt++;
+    }
+
+    // Every test runs over the same triangle/ray pairs, the sum keeps the work from being optimized away. The
+    // watertight setup is per ray, as in a mesh where it is shared by all faces
+    vector<WatertightRay> sheared_rays(rays.begin(), rays.end());
+    auto time_test = [&](auto test)
+    {
+        auto start = chrono::steady_clock::now();
+        double sum = 0;
+        size_t index = 0;
+        for (const Case &triangle : cases)
+            for (int j = 0; j < rays_per_triangle && index < rays.size(); j++, index++)
+                sum += test(triangle, index);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return make_pair(seconds * 1e9 / max<size_t>(1, index), sum);
+    };
+    auto cramer = time_test([&](const Case &triangle, size_t index)
+                            { double beta, gamma; return intersect_triangle_cramer(triangle.a, triangle.b, triangle.c, rays[index], beta, gamma); });
+    auto moller_trumbore = time_test([&](const Case &triangle, size_t index)
+                                     { double beta, gamma; return intersect_triangle(triangle.a, triangle.edge1, triangle.edge2, rays[index], beta, gamma); });
+    auto watertight = time_test([&](const Case &triangle, size_t index)
+                                { double beta, gamma; return intersect_triangle_watertight(triangle.a, triangle.b, triangle.c, sheared_rays[index], beta, gamma); });
+
+    cout << "Triangle tests: " << tests << ", compared away from edges: " << compared << " (" << hits << " hits)" << endl;
+    cout << "Disagreements with Cramer's rule: " << disagreements << endl;
+    cout << "Rays through a shared edge: " << seam_rays << ", missed by Moller-Trumbore: " << leaks_mt
+         << ", missed by watertight: " << leaks_wt << endl;
+    cout << fixed << setprecision(1) << "ns per test: Cramer " << cramer.first << ", Moller-Trumbore " << moller_trumbore.first
+         << ", watertight " << watertight.first << " (checksum " << setprecision(0) << cramer.second + moller_trumbore.second + watertight.second << ")"
+         << defaultfloat << endl;
+    return disagreements + leaks_wt;
+}
+
+// Built by loadData, use_bvh off falls back to testing every object
+BVH object_bvh;
+bool use_bvh = true;
+
+void build_object_bvh()
+{
+    const double inf = numeric_limits<double>::infinity();
+    vector<AABB> boxes(objects.size());
+    for (int i = 0; i < (int)objects.size(); i++)
+        if (!objects[i]->get_bounds(boxes[i]))
+            boxes[i] = AABB(Vector(-inf, -inf, -inf), Vector(inf, inf, inf));
+    object_bvh.build(boxes);
+}
+
+bool find_closest_hit(const Ray &ray, HitRecord &hit, double t_min, double t_max)
+{
+    int closest = -1;
+    if (use_bvh)
+        closest = object_bvh.closest(ray, t_min, t_max, [&](int id, HitRecord &candidate)
+                                     { return objects[id]->intersect(ray, candidate); }, hit);
+    else
+    {
+        double min_t = t_max;
+        for (int i = 0; i < objects.size(); i++)
+        {
+            HitRecord candidate;
+            double t = objects[i]->intersect(ray, candidate);
+            if (t > t_min && t < min_t)
+            {
+                min_t = t;
+                closest = i;
+                hit = candidate;
+            }
+        }
+    }
+
+    if (closest == -1)
+        return false;
+    objects[closest]->complete_hit(ray, hit);
+    return true;
+}
+
+void find_closest_hits(const RayPacket &packet, HitRecord *hits, bool *found, double t_min, double t_max)
+{
+    auto intersect = [&](int id, PacketHits &candidates)
+    { objects[id]->intersect_packet(packet, candidates); };
+
+    int best[RayPacket::MAX_SIZE];
+    if (use_bvh)
+        object_bvh.closest_packet(packet, t_min, t_max, intersect, best, hits);
+    else
+    {
+        // Ties go to the first object, as in the single ray scan
+        fill(best, best + packet.size, -1);
+        PacketHits candidates;
+        for (int i = 0; i < (int)objects.size(); i++)
+        {
+            intersect(i, candidates);
+            BVH::test_packet(i, packet.size, candidates, t_min, t_max, best, hits);
+        }
+    }
+
+    for (int lane = 0; lane < packet.size; lane++)
+    {
+        found[lane] = best[lane] != -1;
+        if (found[lane])
+            objects[best[lane]]->complete_hit(packet.ray(lane), hits[lane]);
+    }
+}
+
+bool is_occluded(const Ray &ray, double t_min, double t_max)
+{
+    if (use_bvh)
+        return object_bvh.any(ray, t_min, t_max, [&](int id)
+                              { return objects[id]->occluded(ray, t_min, t_max); });
+
+    for (auto obj : objects)
+        if (obj->occluded(ray, t_min, t_max))
+            return true;
+    return false;
+}
+
+// Worker threads kept from one capture to the next. run() deals the tiles out in contiguous runs, one deque
+// per worker; a worker takes tiles from the front of its own deque and, once it is empty, steals from the
+// back of the others, so that workers stuck on expensive tiles get help.
+class TilePool
+{
+public:
+    struct Tile
+    {
+        // Pixels [x0, x1) x [y0, y1)
+        int x0, y0, x1, y1;
+    };
+
+private:
+    struct Worker
+    {
+        mutex lock;
+        deque<int> tiles;
+        double busy_seconds = 0;
+        int stolen = 0;
+    };
+
+    vector<thread> threads;
+    vector<unique_ptr<Worker>> workers;
+
+    mutex state_lock;
+    condition_variable start_signal, done_signal;
+    int generation = 0, running = 0;
+    bool stopping = false;
+
+    const vector<Tile> *tiles = nullptr;
+    function<void(const Tile &)> work;
+
+    bool next_tile(int index, int &tile)
+    {
+        {
+            Worker &own = *workers[index];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tiles.empty())
+            {
+                tile = own.tiles.front();
+                own.tiles.pop_front();
+                return true;
+            }
+        }
+        for (int k = 1; k < (int)workers.size(); k++)
+        {
+            Worker &victim = *workers[(index + k) % workers.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tiles.empty())
+            {
+                tile = victim.tiles.back();
+                victim.tiles.pop_back();
+                workers[index]->stolen++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop(int index)
+    {
+        int seen = 0;
+        while (true)
+        {
+            {
+                unique_lock<mutex> guard(state_lock);
+                start_signal.wait(guard, [&]
+                                  { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+
+            int tile;
+            while (next_tile(index, tile))
+            {
+                auto start = chrono::steady_clock::now();
+                work((*tiles)[tile]);
+                workers[index]->busy_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            }
+
+            lock_guard<mutex> guard(state_lock);
+            if (--running == 0)
+                done_signal.notify_one();
+        }
+    }
+
+public:
+    explicit TilePool(int num_threads)
+    {
+        for (int i = 0; i < num_threads; i++)
+            workers.push_back(make_unique<Worker>());
+        for (int i = 0; i < num_threads; i++)
+            threads.emplace_back(&TilePool::worker_loop, this, i);
+    }
+
+    ~TilePool()
+    {
+        {
+            lock_guard<mutex> guard(state_lock);
+            stopping = true;
+        }
+        start_signal.notify_all();
+        for (thread &t : threads)
+            t.join();
+    }
+
+    int size() const
+    {
+        return workers.size();
+    }
+
+    // Calls tile_work on every tile and returns when all are done
+    void run(const vector<Tile> &tile_list, const function<void(const Tile &)> &tile_work)
+    {
+        int n = tile_list.size(), num_workers = workers.size();
+        for (int i = 0; i < num_workers; i++)
+        {
+            Worker &worker = *workers[i];
+            lock_guard<mutex> guard(worker.lock);
+            worker.tiles.clear();
+            for (int k = (long long)i * n / num_workers; k < (long long)(i + 1) * n / num_workers; k++)
+                worker.tiles.push_back(k);
+            worker.busy_seconds = 0;
+            worker.stolen = 0;
+        }
+
+        unique_lock<mutex> guard(state_lock);
+        tiles = &tile_list;
+        work = tile_work;
+        running = num_workers;
+        generation++;
+        start_signal.notify_all();
+        done_signal.wait(guard, [&]
+                         { return running == 0; });
+    }
+
+    // Of the last run, per worker
+    double busy_seconds(int index) const
+    {
+        return workers[index]->busy_seconds;
+    }
+
+    int stolen(int index) const
+    {
+        return workers[index]->stolen;
+    }
+};
+
+// size x size tiles covering a width x height image, in Morton (Z curve) order so that consecutive tiles,
+// and with them the runs dealt to each worker, are close together on screen
+vector<TilePool::Tile> morton_tiles(int width, int height, int size)
+{
+    auto morton = [](unsigned x, unsigned y)
+    {
+        unsigned long long code = 0;
+        for (int bit = 0; bit < 32; bit++)
+            code |= (unsigned long long)((x >> bit) & 1) << (2 * bit) | (unsigned long long)((y >> bit) & 1) << (2 * bit + 1);
+        return code;
+    };
+
+    vector<pair<unsigned long long, TilePool::Tile>> ordered;
+    for (int ty = 0; ty * size < height; ty++)
+        for (int tx = 0; tx * size < width; tx++)
+            ordered.push_back({morton(tx, ty), TilePool::Tile{tx * size, ty * size, min((tx + 1) * size, width), min((ty + 1) * size, height)}});
+    sort(ordered.begin(), ordered.end(), [](const auto &a, const auto &b)
+         { return a.first < b.first; });
+
+    vector<TilePool::Tile> tiles;
+    for (auto &entry : ordered)
+        tiles.push_back(entry.second);
+    return tiles;
+}
+
+// Sample positions of pixel (i, j) as offsets from its center, one in each cell of a fine x fine grid.
+// The first set has one sample in each cell of a coarse x coarse grid (fine is a multiple of coarse) and
+// the other set fills the fine cells it left empty, so a pixel that gets both is stratified on the fine
+// grid. Positions depend only on the pixel, so the sets can be asked for in separate passes
+void pixel_samples(int i, int j, int coarse, int fine, bool first_set, vector<pair<double, double>> &offsets)
+{
+    minstd_rand rng((unsigned)i * 73856093u ^ (unsigned)j * 19349663u);
+    uniform_real_distribution<double> unit(0, 1);
+    int ratio = fine / coarse;
+
+    // Fine cell of the first set's sample in each coarse cell
+    vector<bool> in_first_set(fine * fine, false);
+    for (int cy = 0; cy < coarse; cy++)
+        for (int cx = 0; cx < coarse; cx++)
+        {
+            int y = cy * ratio + rng() % ratio;
+            int x = cx * ratio + rng() % ratio;
+            in_first_set[y * fine + x] = true;
+        }
+
+    offsets.clear();
+    for (int y = 0; y < fine; y++)
+        for (int x = 0; x < fine; x++)
+        {
+            // Drawn for every cell so that both sets see the same sequence
+            double dx = unit(rng), dy = unit(rng);
+            if (in_first_set[y * fine + x] == first_set)
+                offsets.push_back({(x + dx) / fine - 0.5, (y + dy) / fine - 0.5});
+        }
+}
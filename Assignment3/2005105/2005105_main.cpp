@@ -15,6 +15,26 @@ using namespace chrono;
 string input_file;
 bool use_multithreading = true;
 unsigned int num_threads = thread::hardware_concurrency();
+// Primary rays per packet: 4, 8 or 16 for 2x2, 4x2 or 4x4 pixel blocks, 1 traces pixels one by one
+int packet_size = 16;
+
+// Progressive captures trace every progressive_stride-th pixel first and halve the stride each pass,
+// writing a preview when progressive_interval seconds have passed since the last one. The 'r' key toggles
+// them, headless renders set all three with --progressive [stride] and --interval
+bool progressive = false;
+int progressive_stride = 8;
+double progressive_interval = 1.0;
+
+// Adaptive anti-aliasing traces adaptive_min_grid^2 stratified samples per pixel, then goes up to
+// adaptive_max_grid^2 where the samples, or the pixel and a neighbor, differ by more than adaptive_threshold
+// in a channel. A heatmap of the samples per pixel is saved next to the capture
+bool adaptive_sampling = false;
+int adaptive_min_grid = 2, adaptive_max_grid = 4;
+double adaptive_threshold = 0.1;
+
+// Square tiles handed to the render threads, kept between captures
+const int TILE_SIZE = 16;
+unique_ptr<TilePool> render_pool;
 
 bool texture_mode = false;
 
@@ -33,8 +53,9 @@ void display();
 void idle_func();
 void key_input(unsigned char key, int x, int y);
 void special_key_input(int key, int x, int y);
-void loadData(const string &filename);
-void capture();
+bool loadData(const string &filename);
+void capture(const Camera &view, const string &filename);
+int render_headless(int argc, char **argv);
 void cleanup();
 
 void initialize()
@@ -46,77 +67,310 @@ void initialize()
     gluPerspective(view_angle, 1.0, 1.0, far_plane_distance);
 }
 
-void capture()
+// Renders the loaded scene as seen from view into filename
+void capture(const Camera &view, const string &filename)
 {
     bitmap_image image(image_width, image_height);
     image.set_all_channels(0, 0, 0);
 
     double plane_distance = 1.0;
     double window_size = 2 * tan(view_angle * PI / 360.0) * plane_distance;
-    Vector top_left = camera.pos + plane_distance * camera.look -
-                      (window_size / 2.0) * camera.right +
-                      (window_size / 2.0) * camera.up +
-                      0.5 * (camera.right * (window_size / image_width)) -
-                      0.5 * (camera.up * (window_size / image_height));
+    Vector top_left = view.pos + plane_distance * view.look -
+                      (window_size / 2.0) * view.right +
+                      (window_size / 2.0) * view.up +
+                      0.5 * (view.right * (window_size / image_width)) -
+                      0.5 * (view.up * (window_size / image_height));
+
+    // Through (i, j) in pixel units, pixel centers being at whole coordinates
+    auto primary_ray = [&](double i, double j)
+    {
+        Vector pixel = top_left + i * (window_size / image_width) * view.right -
+                       j * (window_size / image_height) * view.up;
+        return Ray(pixel, pixel - view.pos);
+    };
 
-    auto render_range = [&](int start_col, int end_col)
+    // Shadows are traced ray by ray from here, and so are the reflections of a single sample
+    auto shade_sample = [&](const Ray &ray, const HitRecord *hit)
     {
-        for (int i = start_col; i < end_col; ++i)
+        Color color(0, 0, 0);
+        if (hit && view.look.dot(hit->t * ray.dir) <= far_plane_distance)
         {
-            for (int j = 0; j < image_height; ++j)
-            {
-                Vector pixel = top_left + i * (window_size / image_width) * camera.right -
-                               j * (window_size / image_height) * camera.up;
-                Ray ray(pixel, pixel - camera.pos);
+            hit->object->shade(ray, *hit, color, reflection_depth);
+            color.clamp();
+        }
+        return color;
+    };
+
+    // shade_sample for every lane of a packet, tracing the reflections in packets while they stay coherent
+    auto shade_samples = [&](const RayPacket &packet, const HitRecord *hits, bool *found, Color *colors)
+    {
+        for (int lane = 0; lane < packet.size; lane++)
+            found[lane] = found[lane] && view.look.dot(hits[lane].t * packet.ray(lane).dir) <= far_plane_distance;
+        Object::shade_packet(packet, hits, found, colors, reflection_depth);
+        for (int lane = 0; lane < packet.size; lane++)
+            colors[lane].clamp();
+    };
+
+    // Misses are written too, as black, since a progressive preview may have filled the pixel before
+    auto set_pixel = [&](int i, int j, const Color &color)
+    { image.set_pixel(i, j, 255 * color.r, 255 * color.g, 255 * color.b); };
+    auto shade_pixel = [&](int i, int j, const Ray &ray, const HitRecord *hit)
+    { set_pixel(i, j, shade_sample(ray, hit)); };
+
+    int packet_width = packet_size >= 8 ? 4 : packet_size >= 4 ? 2 : 1;
+    int packet_height = packet_size >= 16 ? 4 : packet_size >= 4 ? 2 : 1;
+
+    // Traces the pixels of the tile whose coordinates are multiples of stride, leaving out those that are
+    // multiples of 2 * stride when an earlier pass already traced them
+    auto render_tile = [&](const TilePool::Tile &tile, int stride, bool skip_traced)
+    {
+        auto traced = [&](int i, int j)
+        { return skip_traced && i % (2 * stride) == 0 && j % (2 * stride) == 0; };
+        int first_i = (tile.x0 + stride - 1) / stride * stride, first_j = (tile.y0 + stride - 1) / stride * stride;
 
-                int closest = -1;
-                double min_t = 1e9;
-                for (int k = 0; k < objects.size(); ++k)
+        if (packet_width * packet_height == 1)
+        {
+            for (int j = first_j; j < tile.y1; j += stride)
+            {
+                for (int i = first_i; i < tile.x1; i += stride)
                 {
-                    double t = objects[k]->intersect(ray);
-                    if (t > 0 && t < min_t)
-                    {
-                        min_t = t;
-                        closest = k;
-                    }
+                    if (traced(i, j))
+                        continue;
+                    Ray ray = primary_ray(i, j);
+                    HitRecord hit;
+                    shade_pixel(i, j, ray, find_closest_hit(ray, hit) ? &hit : nullptr);
                 }
+            }
+            return;
+        }
 
-                if (closest == -1)
+        // Blocks of the pass's pixels, clipped to the tile
+        for (int j0 = first_j; j0 < tile.y1; j0 += packet_height * stride)
+        {
+            for (int i0 = first_i; i0 < tile.x1; i0 += packet_width * stride)
+            {
+                RayPacket packet;
+                int columns[RayPacket::MAX_SIZE], rows[RayPacket::MAX_SIZE];
+                for (int j = j0; j < min(j0 + packet_height * stride, tile.y1); j += stride)
+                    for (int i = i0; i < min(i0 + packet_width * stride, tile.x1); i += stride)
+                        if (!traced(i, j))
+                        {
+                            columns[packet.size] = i, rows[packet.size] = j;
+                            packet.add(primary_ray(i, j));
+                        }
+                if (!packet.size)
                     continue;
-                double dist = camera.look.dot(min_t * ray.dir);
-                if (dist > far_plane_distance)
+
+                HitRecord hits[RayPacket::MAX_SIZE];
+                bool found[RayPacket::MAX_SIZE];
+                Color colors[RayPacket::MAX_SIZE];
+                find_closest_hits(packet, hits, found);
+                shade_samples(packet, hits, found, colors);
+                for (int lane = 0; lane < packet.size; lane++)
+                    set_pixel(columns[lane], rows[lane], colors[lane]);
+            }
+        }
+    };
+
+    bool threaded = use_multithreading && num_threads > 1;
+    if (threaded && (!render_pool || render_pool->size() != (int)num_threads))
+        render_pool = make_unique<TilePool>(num_threads);
+    vector<double> busy_seconds(threaded ? num_threads : 0);
+    int stolen = 0;
+
+    vector<TilePool::Tile> tiles = morton_tiles(image_width, image_height, TILE_SIZE);
+    auto render_pass = [&](const function<void(const TilePool::Tile &)> &tile_work)
+    {
+        if (!threaded)
+        {
+            for (const TilePool::Tile &tile : tiles)
+                tile_work(tile);
+            return;
+        }
+
+        render_pool->run(tiles, tile_work);
+        for (int i = 0; i < render_pool->size(); ++i)
+        {
+            busy_seconds[i] += render_pool->busy_seconds(i);
+            stolen += render_pool->stolen(i);
+        }
+    };
+
+    // Running sums of the samples of each pixel, and the pixels picked for more
+    vector<Color> sample_sum, sample_square_sum;
+    vector<int> sample_count;
+    vector<char> refine;
+
+    // Adds the first or the second set of samples to the pixels of the tile and writes their means
+    auto sample_tile = [&](const TilePool::Tile &tile, bool first_set)
+    {
+        vector<Ray> rays;
+        vector<int> owners;
+        vector<pair<double, double>> offsets;
+        for (int j = tile.y0; j < tile.y1; ++j)
+        {
+            for (int i = tile.x0; i < tile.x1; ++i)
+            {
+                if (!first_set && !refine[j * image_width + i])
                     continue;
+                pixel_samples(i, j, adaptive_min_grid, adaptive_max_grid, first_set, offsets);
+                for (auto &offset : offsets)
+                {
+                    rays.push_back(primary_ray(i + offset.first, j + offset.second));
+                    owners.push_back(j * image_width + i);
+                }
+            }
+        }
 
-                Color color(0, 0, 0);
-                objects[closest]->shade(ray, color, reflection_depth);
-                color.clamp();
+        // Consecutive samples lie in the same or neighboring pixels, so they make up the packets
+        int width = packet_width * packet_height;
+        for (size_t first = 0; first < rays.size(); first += width)
+        {
+            int count = min((size_t)width, rays.size() - first);
+            HitRecord hits[RayPacket::MAX_SIZE];
+            bool found[RayPacket::MAX_SIZE];
+            Color colors[RayPacket::MAX_SIZE];
+            if (count == 1)
+                colors[0] = shade_sample(rays[first], find_closest_hit(rays[first], hits[0]) ? &hits[0] : nullptr);
+            else
+            {
+                RayPacket packet;
+                for (int lane = 0; lane < count; lane++)
+                    packet.add(rays[first + lane]);
+                find_closest_hits(packet, hits, found);
+                shade_samples(packet, hits, found, colors);
+            }
 
-                image.set_pixel(i, j, 255 * color.r, 255 * color.g, 255 * color.b);
+            for (int lane = 0; lane < count; lane++)
+            {
+                const Color &color = colors[lane];
+                int pixel = owners[first + lane];
+                sample_sum[pixel] += color;
+                sample_square_sum[pixel] += color * color;
+                sample_count[pixel]++;
             }
         }
+
+        for (int j = tile.y0; j < tile.y1; ++j)
+            for (int i = tile.x0; i < tile.x1; ++i)
+                if (first_set || refine[j * image_width + i])
+                    set_pixel(i, j, sample_sum[j * image_width + i] * (1.0 / sample_count[j * image_width + i]));
     };
 
-    if (use_multithreading && num_threads > 1)
+    auto start_time = steady_clock::now();
+    if (adaptive_sampling)
     {
-        vector<thread> workers;
-        int cols_per_thread = image_width / num_threads;
-        for (int i = 0; i < num_threads; ++i)
+        int pixels = image_width * image_height;
+        sample_sum.assign(pixels, Color());
+        sample_square_sum.assign(pixels, Color());
+        sample_count.assign(pixels, 0);
+        refine.assign(pixels, 0);
+
+        render_pass([&](const TilePool::Tile &tile)
+                    { sample_tile(tile, true); });
+        if (progressive)
+        {
+            image.save_image(filename);
+            cout << "Preview from " << adaptive_min_grid * adaptive_min_grid << " samples per pixel: " << filename << endl;
+        }
+
+        // Pixels whose samples spread too far, and both sides of every edge between too different neighbors
+        vector<Color> mean(pixels);
+        for (int pixel = 0; pixel < pixels; ++pixel)
         {
-            int start = i * cols_per_thread;
-            int end = (i == num_threads - 1) ? image_width : (i + 1) * cols_per_thread;
-            workers.emplace_back(render_range, start, end);
+            mean[pixel] = sample_sum[pixel] * (1.0 / sample_count[pixel]);
+            Color square_mean = sample_square_sum[pixel] * (1.0 / sample_count[pixel]);
+            double variance = max({square_mean.r - mean[pixel].r * mean[pixel].r, square_mean.g - mean[pixel].g * mean[pixel].g,
+                                   square_mean.b - mean[pixel].b * mean[pixel].b});
+            if (variance > adaptive_threshold * adaptive_threshold)
+                refine[pixel] = 1;
+        }
+        auto differ = [&](int a, int b)
+        {
+            return max({fabs(mean[a].r - mean[b].r), fabs(mean[a].g - mean[b].g), fabs(mean[a].b - mean[b].b)}) > adaptive_threshold;
+        };
+        for (int j = 0; j < image_height; ++j)
+        {
+            for (int i = 0; i < image_width; ++i)
+            {
+                int pixel = j * image_width + i;
+                if (i + 1 < image_width && differ(pixel, pixel + 1))
+                    refine[pixel] = refine[pixel + 1] = 1;
+                if (j + 1 < image_height && differ(pixel, pixel + image_width))
+                    refine[pixel] = refine[pixel + image_width] = 1;
+            }
+        }
+
+        if (adaptive_max_grid > adaptive_min_grid)
+            render_pass([&](const TilePool::Tile &tile)
+                        { sample_tile(tile, false); });
+
+        long long samples = accumulate(sample_count.begin(), sample_count.end(), 0LL);
+        cout << "Adaptive sampling: " << count(refine.begin(), refine.end(), 1) << " of " << pixels
+             << " pixels refined, " << (double)samples / pixels << " samples per pixel" << endl;
+
+        // Blue for the fewest samples up to red for the most
+        bitmap_image heatmap(image_width, image_height);
+        int fewest = adaptive_min_grid * adaptive_min_grid, most = adaptive_max_grid * adaptive_max_grid;
+        for (int j = 0; j < image_height; ++j)
+        {
+            for (int i = 0; i < image_width; ++i)
+            {
+                int samples_here = sample_count[j * image_width + i];
+                const rgb_store &color = jet_colormap[most > fewest ? (samples_here - fewest) * 999 / (most - fewest) : 0];
+                heatmap.set_pixel(i, j, color.red, color.green, color.blue);
+            }
+        }
+        string heatmap_filename = filename.substr(0, filename.rfind('.')) + "_samples.bmp";
+        heatmap.save_image(heatmap_filename);
+        cout << "Saved: " << heatmap_filename << endl;
+    }
+    else if (progressive)
+    {
+        // Passes from every first_stride-th pixel down to every pixel, each tracing only the pixels the
+        // previous ones left out
+        int first_stride = 1;
+        while (first_stride * 2 <= progressive_stride)
+            first_stride *= 2;
+
+        auto last_preview = start_time;
+        for (int stride = first_stride; stride >= 1; stride /= 2)
+        {
+            render_pass([&](const TilePool::Tile &tile)
+                        { render_tile(tile, stride, stride != first_stride); });
+            if (stride == 1 || duration<double>(steady_clock::now() - last_preview).count() < progressive_interval)
+                continue;
+
+            // Untraced pixels show the traced pixel at the corner of their stride x stride block
+            for (int j = 0; j < image_height; ++j)
+                for (int i = 0; i < image_width; ++i)
+                    if (i % stride || j % stride)
+                    {
+                        unsigned char r, g, b;
+                        image.get_pixel(i - i % stride, j - j % stride, r, g, b);
+                        image.set_pixel(i, j, r, g, b);
+                    }
+            image.save_image(filename);
+            last_preview = steady_clock::now();
+            cout << "Preview from every " << stride << " x " << stride << " block: " << filename << endl;
         }
-        for (auto &t : workers)
-            t.join();
     }
     else
+        render_pass([&](const TilePool::Tile &tile)
+                    { render_tile(tile, 1, false); });
+
+    cout << fixed << setprecision(3) << "Rendered " << tiles.size() << " tiles in "
+         << duration<double>(steady_clock::now() - start_time).count() << " s";
+    if (threaded)
     {
-        render_range(0, image_width);
+        cout << ", busy time per thread:";
+        for (double seconds : busy_seconds)
+            cout << " " << seconds;
+        cout << " s, " << stolen << " tiles stolen";
     }
+    cout << defaultfloat << endl;
 
-    string filename = "Output_1" + to_string(++captured_images) + ".bmp";
     image.save_image(filename);
-
     cout << "Saved: " << filename << endl;
 }
 
@@ -128,15 +382,16 @@ void cleanup()
     for (auto *l : light_sources)
         delete l;
     light_sources.clear();
+    render_pool.reset();
 }
 
-void loadData(const string &filename)
+bool loadData(const string &filename)
 {
     ifstream file(filename);
     if (!file.is_open())
     {
         cerr << "Failed to open input file." << endl;
-        return;
+        return false;
     }
 
     int resolution;
@@ -195,6 +450,38 @@ void loadData(const string &filename)
             o->set_shine(shine);
             objects.push_back(o);
         }
+        else if (type == "mesh")
+        {
+            // File relative to the scene file, then position, rotation about x, y and z in degrees and scale
+            string mesh_file;
+            double pos[3], rot[3], scale, r, g, b, amb, diff, spec, refl;
+            int shine;
+            file >> mesh_file;
+            for (int i = 0; i < 3; ++i)
+                file >> pos[i];
+            for (int i = 0; i < 3; ++i)
+                file >> rot[i];
+            file >> scale >> r >> g >> b >> amb >> diff >> spec >> refl >> shine;
+
+            size_t slash = filename.find_last_of('/');
+            if (mesh_file[0] != '/' && slash != string::npos)
+                mesh_file = filename.substr(0, slash + 1) + mesh_file;
+
+            vector<Vector> vertices;
+            vector<array<int, 3>> faces;
+            if (!load_mesh(mesh_file, vertices, faces))
+                continue;
+            for (Vector &v : vertices)
+                v = (v * scale).rotate(Vector(1, 0, 0), rot[0]).rotate(Vector(0, 1, 0), rot[1]).rotate(Vector(0, 0, 1), rot[2]) +
+                    Vector(pos[0], pos[1], pos[2]);
+
+            Object *o = new Mesh(vertices, faces);
+            o->set_color(r, g, b);
+            o->set_coefficients(amb, diff, spec, refl);
+            o->set_shine(shine);
+            objects.push_back(o);
+            cout << "Loaded mesh: " << mesh_file << " (" << faces.size() << " triangles)" << endl;
+        }
         else
         {
             cerr << "Unknown object type: " << type << endl;
@@ -225,6 +512,8 @@ void loadData(const string &filename)
     }
 
     file.close();
+    build_object_bvh();
+    return true;
 }
 
 void display()
@@ -254,7 +543,7 @@ void key_input(unsigned char key, int, int)
     switch (key)
     {
     case '0':
-        capture();
+        capture(camera, "Output_1" + to_string(++captured_images) + ".bmp");
         break;
     case '1':
         camera.look_left();
@@ -284,6 +573,22 @@ void key_input(unsigned char key, int, int)
         texture_mode = !texture_mode;
         cout << "Texture mode: " << (texture_mode ? "ON" : "OFF") << endl;
         break;
+    case 'b':
+        use_bvh = !use_bvh;
+        cout << "BVH: " << (use_bvh ? "ON" : "OFF") << endl;
+        break;
+    case 'r':
+        progressive = !progressive;
+        cout << "Progressive capture: " << (progressive ? "ON" : "OFF") << endl;
+        break;
+    case 'a':
+        adaptive_sampling = !adaptive_sampling;
+        cout << "Adaptive anti-aliasing: " << (adaptive_sampling ? "ON" : "OFF") << endl;
+        break;
+    case 'p':
+        packet_size = packet_size >= 16 ? 1 : packet_size == 1 ? 4 : packet_size * 2;
+        cout << "Ray packet size: " << packet_size << endl;
+        break;
     default:
         break;
     }
@@ -318,6 +623,13 @@ void special_key_input(int key, int, int)
 
 int main(int argc, char **argv)
 {
+    // Verification of the triangle intersection code, no window
+    if (argc > 1 && string(argv[1]) == "--check-triangles")
+        return check_triangle_intersection() ? 1 : 0;
+    // Renders one image from the command line, no window
+    if (argc > 1 && string(argv[1]) == "--headless")
+        return render_headless(argc, argv);
+
     input_file = "scene.txt";
     loadTexture("texture1.jpg");
 
@@ -347,3 +659,132 @@ int main(int argc, char **argv)
 
     return 0;
 }
+
+// --headless --scene <file> [--eye x y z] [--look x y z] [--up x y z] [--fov degrees] [--resolution n]
+//            [--depth n] [--threads n] [--adaptive] [--progressive [stride]] [--interval seconds]
+//            [--texture <file>] [--output <file>]
+// look is the point looked at. Resolution and reflection depth default to the scene file's. Progressive
+// previews overwrite the output file every interval seconds
+int render_headless(int argc, char **argv)
+{
+    string scene_file, output_file = "Output.bmp", texture_file;
+    Vector eye = camera.pos, center = camera.pos + camera.look, up = camera.up;
+    int resolution = 0, depth = -1;
+    Camera view;
+
+    auto usage = [&]()
+    {
+        cerr << "Usage: " << argv[0] << " --headless --scene <file> [--eye x y z] [--look x y z] [--up x y z] [--fov degrees]"
+             << " [--resolution n] [--depth n] [--threads n] [--adaptive] [--progressive [stride]] [--interval seconds]"
+             << " [--texture <file>] [--output <file>]" << endl;
+        return 1;
+    };
+
+    try
+    {
+        // Whole arguments only, "8x" is no number
+        auto number_at = [&](int k)
+        {
+            size_t used;
+            double value = stod(argv[k], &used);
+            if (argv[k][used])
+                throw invalid_argument(argv[k]);
+            return value;
+        };
+        auto integer_at = [&](int k, int lo, int hi)
+        {
+            size_t used;
+            int value = stoi(argv[k], &used);
+            if (argv[k][used] || value < lo || value > hi)
+                throw invalid_argument(argv[k]);
+            return value;
+        };
+
+        for (int k = 2; k < argc; ++k)
+        {
+            string option = argv[k];
+            // Values following the option, the stride of --progressive is optional
+            int values = option == "--eye" || option == "--look" || option == "--up" ? 3 : option == "--adaptive" ? 0 : 1;
+            if (option == "--progressive" && (k + 1 >= argc || string(argv[k + 1]).compare(0, 2, "--") == 0))
+                values = 0;
+            if (k + values >= argc)
+                return usage();
+            auto vector_at = [&](int first)
+            { return Vector(number_at(first), number_at(first + 1), number_at(first + 2)); };
+
+            if (option == "--scene")
+                scene_file = argv[k + 1];
+            else if (option == "--eye")
+                eye = vector_at(k + 1);
+            else if (option == "--look")
+                center = vector_at(k + 1);
+            else if (option == "--up")
+                up = vector_at(k + 1);
+            else if (option == "--fov")
+            {
+                view_angle = number_at(k + 1);
+                if (!(view_angle > 0 && view_angle < 180))
+                    return usage();
+            }
+            else if (option == "--resolution")
+                resolution = integer_at(k + 1, 1, 16384);
+            else if (option == "--depth")
+                depth = integer_at(k + 1, 0, 1000);
+            else if (option == "--threads")
+                num_threads = integer_at(k + 1, 1, 1024);
+            else if (option == "--adaptive")
+                adaptive_sampling = true;
+            else if (option == "--progressive")
+            {
+                progressive = true;
+                if (values)
+                    progressive_stride = integer_at(k + 1, 1, 1024);
+            }
+            else if (option == "--interval")
+            {
+                progressive_interval = number_at(k + 1);
+                if (!(progressive_interval >= 0))
+                    return usage();
+            }
+            else if (option == "--texture")
+                texture_file = argv[k + 1];
+            else if (option == "--output")
+                output_file = argv[k + 1];
+            else
+                return usage();
+            k += values;
+        }
+
+        // The up vector has to leave a direction across the view
+        Vector look = center - eye;
+        if (scene_file.empty() || look.dot(look) <= EPS || look.cross(up).norm() <= EPS * look.norm() * up.norm())
+            return usage();
+        view = Camera(eye, center, up);
+    }
+    catch (const exception &)
+    {
+        return usage();
+    }
+
+    if (!loadData(scene_file))
+        return 1;
+    if (resolution > 0)
+        image_width = image_height = resolution;
+    if (depth >= 0)
+        reflection_depth = depth;
+    if (!texture_file.empty())
+    {
+        loadTexture(texture_file);
+        texture_mode = textureData != nullptr;
+    }
+
+    capture(view, output_file);
+
+    cleanup();
+    if (textureData)
+    {
+        stbi_image_free(textureData);
+        textureData = nullptr;
+    }
+    return 0;
+}